@@ -0,0 +1,418 @@
+// Benchmarks of the hot kernels, at the sizes people actually make, from
+// fixed seeds, so that runs of different builds can be compared.
+//
+// Each test case is tagged by kernel, so one can run alone, e.g.:
+//
+//     bin/bench "[dither]" --benchmark-samples 10
+//
+// The 4096x4096 cases take seconds per sample, and Catch takes 100 samples
+// by default, so it's worth asking for fewer.
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "array2d.hpp"
+#include "colors.hpp"
+#include "grid.hpp"
+#include "hilbert.hpp"
+#include "image.hpp"
+#include "pairing.hpp"
+#include "parallel.hpp"
+#include "permutations.hpp"
+
+
+namespace {
+
+struct bench_size
+{
+    std::string name;
+    size_t rows;
+    size_t cols;
+
+    size_t pixels() const
+    {
+        return rows * cols;
+    }
+};
+
+std::vector<bench_size> const sizes {{"1080p", 1080, 1920}, {"4096x4096", 4096, 4096}};
+
+
+char const * pairs_name(pairing pairs)
+{
+    return pairs == pairing::shuffled ? "shuffled" : "blocked";
+}
+
+
+char const * order_name(traversal order)
+{
+    switch (order)
+    {
+    case traversal::sdfs:
+        return "sdfs";
+    case traversal::dfs:
+        return "dfs";
+    case traversal::bfs:
+        return "bfs";
+    }
+
+    return "";
+}
+
+
+// Something like a photograph: smooth gradients, with a little noise.
+array2d<rgb> photo(bench_size const & size)
+{
+    permute_rng_type rng {1};
+    array2d<rgb> image(size.rows, size.cols);
+    for (size_t row = 0; row < size.rows; row++)
+    {
+        for (size_t col = 0; col < size.cols; col++)
+        {
+            auto const x = static_cast<double>(col) / static_cast<double>(size.cols);
+            auto const y = static_cast<double>(row) / static_cast<double>(size.rows);
+            auto const wave = 0.5 + 0.5 * std::sin(12 * x + 7 * y);
+            auto const noise = static_cast<double>(rng() % 16);
+            auto const channel = [&](double value) {
+                return std::clamp(value * 239 + noise, 0.0, 255.0);
+            };
+
+            image(row, col).r = static_cast<uint8_t>(channel(x));
+            image(row, col).g = static_cast<uint8_t>(channel(y));
+            image(row, col).b = static_cast<uint8_t>(channel(wave));
+        }
+    }
+
+    return image;
+}
+
+
+// The image `permute` starts from: a shuffled palette.
+array2d<rgb> shuffled_palette(bench_size const & size)
+{
+    permute_rng_type rng {2};
+    array2d<rgb> image(size.rows, size.cols);
+    image.data = make_palette(size.pixels());
+    std::shuffle(image.data.begin(), image.data.end(), rng);
+    return image;
+}
+
+} // anonymous namespace
+
+
+TEST_CASE("Hilbert curve", "[hilbert]")
+{
+    for (auto const & size: sizes)
+    {
+        auto const colors = shuffled_palette(size).data;
+        std::vector<unsigned> indices(colors.size());
+        hilbert_encode(colors.data(), colors.size(), indices.data());
+        std::vector<rgb> decoded(colors.size());
+
+        BENCHMARK("hilbert_encode, one at a time, " + size.name)
+        {
+            for (size_t i = 0; i < colors.size(); i++)
+                indices[i] = hilbert_encode(colors[i]);
+            return indices.back();
+        };
+
+        BENCHMARK("hilbert_encode, batch, " + size.name)
+        {
+            hilbert_encode(colors.data(), colors.size(), indices.data());
+            return indices.back();
+        };
+
+        BENCHMARK("hilbert_decode, batch, " + size.name)
+        {
+            hilbert_decode(indices.data(), indices.size(), decoded.data());
+            return decoded.back();
+        };
+
+        BENCHMARK_ADVANCED("sort by hilbert_compare, " + size.name)
+        (Catch::Benchmark::Chronometer meter)
+        {
+            auto const runs = static_cast<size_t>(meter.runs());
+            std::vector<std::vector<rgb>> unsorted(runs, colors);
+            meter.measure([&](int run) {
+                auto & sorting = unsorted[static_cast<size_t>(run)];
+                std::sort(sorting.begin(), sorting.end(), hilbert_compare);
+            });
+        };
+    }
+}
+
+
+TEST_CASE("Palettes", "[palette]")
+{
+    BENCHMARK("make_palette, 2^24 colors")
+    {
+        return make_palette(rgb::num_colors);
+    };
+
+    for (size_t const size: {size_t {1920 * 1080}, size_t {4000 * 4000}})
+    {
+        auto const name = std::to_string(size) + " colors";
+        BENCHMARK("make_palette, " + name)
+        {
+            return make_palette(size);
+        };
+
+        BENCHMARK("make_hilbert_palette, " + name)
+        {
+            return make_hilbert_palette(size);
+        };
+    }
+}
+
+
+TEST_CASE("CIELAB conversion", "[lab]")
+{
+    for (auto const & size: sizes)
+    {
+        auto const image = photo(size);
+        std::vector<lab> converted(image.size());
+
+        BENCHMARK("lab {rgb}, " + size.name)
+        {
+            for (size_t i = 0; i < image.size(); i++)
+                converted[i] = lab {image[i]};
+            return converted.back();
+        };
+
+        // This builds the table the first time, for the large image.
+        BENCHMARK("to_lab, " + size.name)
+        {
+            return to_lab(image);
+        };
+    }
+}
+
+
+TEST_CASE("Shuffling pixel indices", "[shuffle]")
+{
+    for (auto const & size: sizes)
+    {
+        std::vector<pixel_index> idxs(size.pixels());
+        std::iota(idxs.begin(), idxs.end(), 0);
+        shuffle_scratch scratch;
+        permute_rng_type rng {6};
+
+        BENCHMARK("std::shuffle, " + size.name)
+        {
+            std::shuffle(idxs.begin(), idxs.end(), rng);
+            return idxs.back();
+        };
+
+        BENCHMARK("shuffle_indices, " + size.name)
+        {
+            shuffle_indices(idxs, scratch, rng);
+            return idxs.back();
+        };
+    }
+}
+
+
+TEST_CASE("One pass of compare_and_swap", "[swap]")
+{
+    for (auto const & size: sizes)
+    {
+        auto const input = photo(size);
+        auto const start = shuffled_palette(size);
+
+        for (auto const pairs: {pairing::shuffled, pairing::blocked})
+        {
+            swap_options options;
+            options.pairs = pairs;
+            auto const name = std::string {pairs_name(pairs)} + " pairs, " + size.name;
+
+            BENCHMARK_ADVANCED("compare_and_swap, " + name)
+            (Catch::Benchmark::Chronometer meter)
+            {
+                auto const runs = static_cast<size_t>(meter.runs());
+                std::vector<array2d<rgb>> outputs(runs, start);
+                permute_rng_type rng {3};
+                meter.measure([&](int run) {
+                    auto & output = outputs[static_cast<size_t>(run)];
+                    compare_and_swap(input, output, 1, rng, options);
+                });
+            };
+        }
+    }
+}
+
+
+TEST_CASE("One pass of compare_and_swap_coarse", "[coarse]")
+{
+    for (auto const & size: sizes)
+    {
+        auto const input = photo(size);
+        auto const start = shuffled_palette(size);
+
+        BENCHMARK_ADVANCED("compare_and_swap_coarse, " + size.name)
+        (Catch::Benchmark::Chronometer meter)
+        {
+            auto const runs = static_cast<size_t>(meter.runs());
+            std::vector<array2d<rgb>> outputs(runs, start);
+            permute_rng_type rng {3};
+            meter.measure([&](int run) {
+                auto & output = outputs[static_cast<size_t>(run)];
+                compare_and_swap_coarse(input, output, 1, rng);
+            });
+        };
+    }
+}
+
+
+TEST_CASE("One pass of compare_and_swap_dithered", "[dither]")
+{
+    for (auto const & size: sizes)
+    {
+        auto const input = photo(size);
+        auto const start = shuffled_palette(size);
+
+        for (auto const pairs: {pairing::shuffled, pairing::blocked})
+        {
+            swap_options options;
+            options.pairs = pairs;
+            auto const name = std::string {pairs_name(pairs)} + " pairs, " + size.name;
+
+            BENCHMARK_ADVANCED("compare_and_swap_dithered, " + name)
+            (Catch::Benchmark::Chronometer meter)
+            {
+                auto const runs = static_cast<size_t>(meter.runs());
+                std::vector<array2d<rgb>> outputs(runs, start);
+                permute_rng_type rng {4};
+                meter.measure([&](int run) {
+                    auto & output = outputs[static_cast<size_t>(run)];
+                    compare_and_swap_dithered(input, output, 1, rng, options);
+                });
+            };
+        }
+    }
+}
+
+
+// Blocked pairs on 1, 2, 4, ... threads, up to every CPU, pinned so that each
+// thread's blocks stay in its NUMA node's memory. On a machine with more than
+// one socket, the last few cases use them all.
+TEST_CASE("Scaling across threads", "[scaling]")
+{
+    auto const & size = sizes.back();
+    auto const input = photo(size);
+    auto const start = shuffled_palette(size);
+
+    auto const cpus = std::max(std::thread::hardware_concurrency(), 1U);
+    std::vector<unsigned> counts;
+    for (unsigned threads = 1; threads < cpus; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(cpus);
+
+    set_thread_pinning(true);
+    for (auto const threads: counts)
+    {
+        swap_options options;
+        options.pairs = pairing::blocked;
+        options.threads = threads;
+        auto const name = std::to_string(threads) + " threads, " + size.name;
+
+        BENCHMARK_ADVANCED("compare_and_swap, " + name)
+        (Catch::Benchmark::Chronometer meter)
+        {
+            auto const runs = static_cast<size_t>(meter.runs());
+            std::vector<array2d<rgb>> outputs(runs, start);
+            permute_rng_type rng {3};
+            meter.measure([&](int run) {
+                auto & output = outputs[static_cast<size_t>(run)];
+                compare_and_swap(input, output, 1, rng, options);
+            });
+        };
+
+        BENCHMARK_ADVANCED("compare_and_swap_dithered, " + name)
+        (Catch::Benchmark::Chronometer meter)
+        {
+            auto const runs = static_cast<size_t>(meter.runs());
+            std::vector<array2d<rgb>> outputs(runs, start);
+            permute_rng_type rng {4};
+            meter.measure([&](int run) {
+                auto & output = outputs[static_cast<size_t>(run)];
+                compare_and_swap_dithered(input, output, 1, rng, options);
+            });
+        };
+    }
+    set_thread_pinning(false);
+}
+
+
+TEST_CASE("Spanning trees", "[grid]")
+{
+    for (auto const & size: sizes)
+    {
+        BENCHMARK("grid_graph, " + size.name)
+        {
+            grid_graph::rng_type rng {5};
+            return grid_graph {size.rows, size.cols, rng};
+        };
+
+        grid_graph::rng_type rng {5};
+        grid_graph const graph {size.rows, size.cols, rng};
+        for (auto const order: {traversal::sdfs, traversal::dfs, traversal::bfs})
+        {
+            BENCHMARK(std::string {"visit "} + order_name(order) + ", " + size.name)
+            {
+                size_t sum = 0;
+                graph.visit(order, [&](size_t idx) { sum += idx; });
+                return sum;
+            };
+        }
+    }
+}
+
+
+TEST_CASE("Image files", "[png]")
+{
+    // Write into a directory of the benchmark's own, and clear it up after.
+    auto const directory = std::filesystem::temp_directory_path() / "allrgb-bench";
+    std::filesystem::create_directories(directory);
+    auto const png = (directory / "bench.png").string();
+    auto const raw = (directory / "bench.raw").string();
+
+    for (auto const & size: sizes)
+    {
+        auto const image = shuffled_palette(size);
+
+        BENCHMARK("write_image, PNG, " + size.name)
+        {
+            write_image(image, png.c_str());
+        };
+
+        BENCHMARK("write_image, fast PNG, " + size.name)
+        {
+            write_image(image, png.c_str(), png_options::fast());
+        };
+
+        BENCHMARK("load_image, PNG, " + size.name)
+        {
+            return load_image(png.c_str());
+        };
+
+        BENCHMARK("write_image, raw, " + size.name)
+        {
+            write_image(image, raw.c_str());
+        };
+
+        BENCHMARK("load_image, raw, " + size.name)
+        {
+            return load_image(raw.c_str());
+        };
+    }
+
+    std::error_code error;
+    std::filesystem::remove_all(directory, error);
+}
@@ -0,0 +1,6 @@
+// CATCH_CONFIG_ENABLE_BENCHMARKING has to be the same in every file that
+// includes catch.hpp, so it comes from bench/CMakeLists.txt, and the
+// benchmarks get their own main, apart from the tests'.
+#define CATCH_CONFIG_MAIN
+
+#include <catch2/catch.hpp>
@@ -1,13 +1,131 @@
 #ifndef ARRAY2D_HPP
 #define ARRAY2D_HPP
 
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+
+// The index of a pixel, in row-major order, wherever many of them are stored:
+// the shuffled orders of the swap engines, sorted orders, and traversals of
+// spanning trees. Those loops are bound by memory bandwidth, and every image
+// so far has had fewer than 2^32 pixels, so indices are 32 bits unless built
+// with WIDE_PIXEL_INDEX.
+#ifdef WIDE_PIXEL_INDEX
+using pixel_index = uint64_t;
+#else
+using pixel_index = uint32_t;
+#endif
+
+// Throw if an image of `num_pixels` pixels is too large for `pixel_index`.
+inline void check_pixel_index(std::size_t num_pixels)
+{
+    // Indices run up to `num_pixels - 1`.
+    if (num_pixels > 0 and num_pixels - 1 > std::numeric_limits<pixel_index>::max())
+    {
+        auto const bits = std::to_string(std::numeric_limits<pixel_index>::digits);
+        throw std::length_error("image too large for " + bits + "-bit pixel indices");
+    }
+}
+
+
+// An allocator that aligns storage to `Alignment` bytes, e.g. to the start of
+// a cache line, so that records sized to divide a cache line never straddle
+// two of them.
+template <typename T, std::size_t Alignment>
+struct aligned_allocator
+{
+    static_assert(Alignment >= alignof(T), "can't loosen the alignment of T");
+
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = aligned_allocator<U, Alignment>;
+    };
+
+    aligned_allocator() noexcept = default;
+
+    template <typename U>
+    explicit aligned_allocator(aligned_allocator<U, Alignment> const &) noexcept
+    { }
+
+    T * allocate(std::size_t n)
+    {
+        return static_cast<T *>(
+            ::operator new(n * sizeof(T), std::align_val_t {Alignment}));
+    }
+
+    void deallocate(T * ptr, std::size_t) noexcept
+    {
+        ::operator delete(ptr, std::align_val_t {Alignment});
+    }
+
+    bool operator==(aligned_allocator const &) const noexcept
+    {
+        return true;
+    }
+
+    bool operator!=(aligned_allocator const &) const noexcept
+    {
+        return false;
+    }
+};
+
+
+// An allocator that default-initializes elements instead of value-initializing
+// them, so that sizing a vector of trivial elements like `rgb` doesn't write
+// to its memory. The OS places each page on the NUMA node of the thread that
+// writes it first, so an array filled in parallel this way, split the same way
+// as the loops that later use it, keeps each thread's part on its own node.
+// Zeroing it on construction would put it all on the constructing thread's.
+template <typename T, typename Allocator = std::allocator<T>>
+struct first_touch_allocator : Allocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = first_touch_allocator<
+            U,
+            typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
+    };
+
+    first_touch_allocator() noexcept = default;
+
+    template <typename U, typename A>
+    explicit first_touch_allocator(first_touch_allocator<U, A> const & other) noexcept
+        : Allocator(static_cast<A const &>(other))
+    { }
+
+    template <typename U>
+    void construct(U * ptr) noexcept(std::is_nothrow_default_constructible_v<U>)
+    {
+        ::new (static_cast<void *>(ptr)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U * ptr, Args &&... args)
+    {
+        std::allocator_traits<Allocator>::construct(
+            static_cast<Allocator &>(*this), ptr, std::forward<Args>(args)...);
+    }
+};
+
+
 // A simple wrapper to present a vector<T> as a row-major 2D array.
-template <typename T>
+template <typename T, typename Allocator = std::allocator<T>>
 struct array2d
 {
-    using size_type = typename std::vector<T>::size_type;
+    using size_type = typename std::vector<T, Allocator>::size_type;
 
     // Construct the array by default-inserting `rows * cols` instances of T.
     array2d(size_type rows, size_type cols)
@@ -16,8 +134,8 @@ struct array2d
 
     // Construct the array by copying frrom an `array2d<U>` where type `U` is
     // convertable to `T`.
-    template <typename U>
-    explicit array2d(array2d<U> const & other)
+    template <typename U, typename A>
+    explicit array2d(array2d<U, A> const & other)
         : rows {other.rows}
         , cols {other.cols}
         , data(other.data.begin(), other.data.end())
@@ -50,8 +168,58 @@ struct array2d
 
     size_type const rows;
     size_type const cols;
-    std::vector<T> data;
+    std::vector<T, Allocator> data;
 };
 
 
+
+// A row-major 2D array with a border of `border` extra elements on every
+// side, for stencils that read and write past the edges of the array without
+// checking for them. Every element, border included, starts value-initialized,
+// unless `Allocator` is a `first_touch_allocator`.
+//
+// Element (row, col) is at `index(row, col)` of the padded storage, and rows
+// are `stride` elements apart, so the element at an offset of (dr, dc) from it
+// is `dr * stride + dc` away, for offsets of up to `border` each way.
+template <typename T, typename Allocator = std::allocator<T>>
+struct padded_array2d
+{
+    using size_type = typename std::vector<T, Allocator>::size_type;
+
+    padded_array2d(size_type rows, size_type cols, size_type border)
+        : rows {rows}
+        , cols {cols}
+        , border {border}
+        , stride {cols + 2 * border}
+        , data((rows + 2 * border) * stride)
+    { }
+
+    size_type index(size_type row, size_type col) const
+    {
+        return (row + border) * stride + col + border;
+    }
+
+    // The index of element `i`, in row-major order without the border.
+    size_type index(size_type i) const
+    {
+        return index(i / cols, i % cols);
+    }
+
+    T & operator[](size_type idx)
+    {
+        return data[idx];
+    }
+
+    T const & operator[](size_type idx) const
+    {
+        return data[idx];
+    }
+
+    size_type const rows;
+    size_type const cols;
+    size_type const border;
+    size_type const stride;
+    std::vector<T, Allocator> data;
+};
+
 #endif
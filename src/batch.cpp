@@ -0,0 +1,140 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include "array2d.hpp"
+#include "colors.hpp"
+#include "palette_cache.hpp"
+#include "parallel.hpp"
+
+
+namespace {
+
+// Do what `permute` does for a single image, on up to `threads` threads.
+void run_job(
+    batch_job const & job,
+    batch_settings const & settings,
+    unsigned threads,
+    palette_cache & palettes)
+{
+    auto const input = load_image(job.input.c_str());
+    array2d<rgb> output(input.rows, input.cols);
+    output.data = palettes.get(input.size());
+
+    permute_rng_type rng {settings.seed};
+    std::shuffle(output.data.begin(), output.data.end(), rng);
+
+    // Progress from jobs running side by side would only interleave.
+    auto options = settings.options;
+    options.threads = threads;
+    options.progress = nullptr;
+    pipeline {input, output, options}.run(job.stages, rng);
+
+    write_image(output, job.output.c_str(), settings.png);
+}
+
+} // anonymous namespace
+
+
+std::vector<batch_job>
+read_manifest(std::string const & filename, std::vector<stage> const & stages)
+{
+    std::ifstream in {filename};
+    if (not in)
+        throw std::runtime_error("failed to open " + filename);
+
+    std::vector<batch_job> jobs;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); number++)
+    {
+        std::istringstream fields {line};
+        batch_job job;
+        std::string stages_list;
+        std::string extra;
+        if (not (fields >> job.input) or job.input[0] == '#')
+            continue;
+
+        fields >> job.output >> stages_list;
+        job.stages = stages;
+        if (job.output.empty() or fields >> extra or
+            (not stages_list.empty() and not parse_stages(stages_list, job.stages)))
+        {
+            throw std::runtime_error(
+                filename + ":" + std::to_string(number) + ": expected input, "
+                "output, and optional stages");
+        }
+
+        jobs.push_back(std::move(job));
+    }
+
+    return jobs;
+}
+
+
+size_t run_batch(
+    std::vector<batch_job> const & jobs,
+    batch_settings const & settings,
+    std::ostream & log)
+{
+    // Find the large images from their headers. Unreadable ones fail later,
+    // with the rest of the job's errors.
+    std::vector<size_t> large;
+    std::vector<size_t> small;
+    size_t total_pixels = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        size_t pixels = 0;
+        try
+        {
+            auto const [rows, cols] = image_size(jobs[i].input.c_str());
+            pixels = rows * cols;
+        }
+        catch (std::runtime_error const &)
+        { }
+
+        total_pixels += pixels;
+        (pixels >= settings.large_image ? large : small).push_back(i);
+    }
+
+    // Across the whole batch, the CIELAB table is worth it for as many pixels
+    // as it is for one image; see `to_lab`.
+    if (total_pixels >= rgb::num_colors / 4)
+        lab_table::instance();
+
+    palette_cache palettes {settings.palette_directory};
+    std::mutex log_mutex;
+    std::atomic<size_t> failures {0};
+
+    auto const run = [&](batch_job const & job, unsigned threads) {
+        try
+        {
+            run_job(job, settings, threads, palettes);
+            std::lock_guard<std::mutex> const lock {log_mutex};
+            log << job.input << " -> " << job.output << '\n';
+        }
+        catch (std::exception const & error)
+        {
+            failures++;
+            std::lock_guard<std::mutex> const lock {log_mutex};
+            log << job.input << ": " << error.what() << '\n';
+        }
+    };
+
+    auto const threads = std::max(settings.options.threads, 1U);
+    for (auto const i: large)
+        run(jobs[i], threads);
+
+    // Each worker takes the next small image as soon as it's free.
+    std::atomic<size_t> next {0};
+    parallel_for(threads, threads, [&](unsigned, size_t, size_t) {
+        for (auto k = next++; k < small.size(); k = next++)
+            run(jobs[small[k]], 1);
+    });
+
+    return failures;
+}
@@ -0,0 +1,61 @@
+// Running `permute` over many images in one process.
+//
+// A manifest lists the jobs, one per line: an input image, an output image,
+// and optionally a list of stages, as for `parse_stages`, to run instead of
+// the batch's default. Blank lines and lines starting with '#' are skipped.
+// Names are separated by whitespace, so they can't contain any.
+//
+// Each job gives the same output as running `permute` on it alone, with the
+// same options and seed. The batch saves what separate runs can't share: the
+// palette of each size is made once, or not at all with a palette directory,
+// and the CIELAB table is built once if there are enough pixels to pay for it.
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "permutations.hpp"
+#include "pipeline.hpp"
+
+
+struct batch_job
+{
+    std::string input;
+    std::string output;
+    std::vector<stage> stages;
+};
+
+// Read the jobs from a manifest, giving `stages` to those that don't list
+// their own. Throw if the manifest can't be read, or a line is malformed.
+std::vector<batch_job>
+read_manifest(std::string const & filename, std::vector<stage> const & stages);
+
+
+// Settings shared by every job of a batch.
+struct batch_settings
+{
+    // `options.threads` is the size of the worker pool.
+    swap_options options;
+    unsigned seed = 0;
+    png_options png;
+
+    // Where to keep palettes between runs, if anywhere; see palette_cache.hpp.
+    std::string palette_directory;
+
+    // Images with at least this many pixels run one at a time, on every thread.
+    // Smaller ones run one per thread, so that the pool stays busy.
+    size_t large_image = size_t {1} << 20U;
+};
+
+// Run every job, logging each one as it finishes. Jobs that fail are logged
+// and skipped. Return how many failed.
+size_t run_batch(
+    std::vector<batch_job> const & jobs,
+    batch_settings const & settings,
+    std::ostream & log);
+
+#endif
@@ -0,0 +1,145 @@
+#include "checkpoint.hpp"
+
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+
+static_assert(sizeof(rgb) == 3, "checkpoint pixels should be packed 8-bit RGB");
+
+
+namespace {
+
+constexpr std::array<char, 8> magic {'D', 'I', 'T', 'H', 'E', 'R', 'C', '2'};
+
+
+template <typename Int>
+void put(std::ostream & out, Int value)
+{
+    std::array<char, sizeof(Int)> bytes {};
+    for (size_t i = 0; i < bytes.size(); i++)
+        bytes[i] = static_cast<char>(static_cast<uint64_t>(value) >> (8 * i)); // NOLINT
+
+    out.write(bytes.data(), bytes.size());
+}
+
+
+template <typename Int>
+Int get(std::istream & in)
+{
+    std::array<char, sizeof(Int)> bytes {};
+    if (not in.read(bytes.data(), bytes.size()))
+        throw std::runtime_error("checkpoint is truncated");
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes.size(); i++)
+        value |= uint64_t {static_cast<unsigned char>(bytes[i])} << (8 * i); // NOLINT
+
+    return static_cast<Int>(value);
+}
+
+
+void put_indices(std::ostream & out, std::vector<pixel_index> const & idxs)
+{
+    for (auto const idx: idxs)
+        put(out, static_cast<uint32_t>(idx));
+}
+
+
+std::vector<pixel_index> get_indices(std::istream & in, size_t count)
+{
+    std::vector<pixel_index> idxs(count);
+    for (auto & idx: idxs)
+        idx = get<uint32_t>(in);
+
+    return idxs;
+}
+
+} // anonymous namespace
+
+
+void save_checkpoint(checkpoint const & saved, std::string const & filename)
+{
+    auto const & state = saved.dither;
+    if (state.output.size() != saved.rows * saved.cols or
+        state.here_idxs.size() != state.there_idxs.size())
+        throw std::invalid_argument("inconsistent checkpoint");
+    if (state.here_idxs.size() > std::numeric_limits<uint32_t>::max())
+        throw std::length_error("image too large to checkpoint");
+
+    auto const temporary = filename + ".tmp";
+    {
+        std::ofstream out {temporary, std::ios::binary | std::ios::trunc};
+        out.write(magic.data(), magic.size());
+        put<uint64_t>(out, saved.stage);
+        put<uint64_t>(out, static_cast<uint64_t>(state.passes_done));
+        put<uint64_t>(out, state.total_swaps);
+        for (auto const word: state.rng)
+            put<uint64_t>(out, word);
+
+        put<uint64_t>(out, static_cast<uint64_t>(saved.pairs));
+        put<uint64_t>(out, saved.block_size);
+        put<uint64_t>(out, static_cast<uint64_t>(saved.dither_radius));
+
+        put<uint64_t>(out, saved.rows);
+        put<uint64_t>(out, saved.cols);
+        out.write(
+            reinterpret_cast<char const *>(state.output.data()), // NOLINT
+            static_cast<std::streamsize>(state.output.size() * 3));
+
+        put<uint64_t>(out, state.here_idxs.size());
+        put_indices(out, state.here_idxs);
+        put_indices(out, state.there_idxs);
+
+        out.flush();
+        if (not out)
+            throw std::runtime_error("failed to write " + temporary);
+    }
+
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("failed to replace " + filename);
+}
+
+
+checkpoint load_checkpoint(std::string const & filename)
+{
+    std::ifstream in {filename, std::ios::binary};
+    if (not in)
+        throw std::runtime_error("failed to open " + filename);
+
+    std::array<char, 8> start {};
+    if (not in.read(start.data(), start.size()) or start != magic)
+        throw std::runtime_error(filename + " is not a checkpoint");
+
+    checkpoint loaded;
+    auto & state = loaded.dither;
+    loaded.stage = get<uint64_t>(in);
+    state.passes_done = static_cast<int>(get<uint64_t>(in));
+    state.total_swaps = get<uint64_t>(in);
+    for (auto & word: state.rng)
+        word = get<uint64_t>(in);
+
+    auto const pairs = get<uint64_t>(in);
+    if (pairs > static_cast<uint64_t>(pairing::streamed))
+        throw std::runtime_error("checkpoint has an unknown pairing");
+    loaded.pairs = static_cast<pairing>(pairs);
+    loaded.block_size = get<uint64_t>(in);
+    loaded.dither_radius = static_cast<int>(get<uint64_t>(in));
+
+    loaded.rows = get<uint64_t>(in);
+    loaded.cols = get<uint64_t>(in);
+    state.output.resize(loaded.rows * loaded.cols);
+    auto * const pixels = reinterpret_cast<char *>(state.output.data()); // NOLINT
+    if (not in.read(pixels, static_cast<std::streamsize>(state.output.size() * 3)))
+        throw std::runtime_error("checkpoint is truncated");
+
+    auto const count = get<uint64_t>(in);
+    if (count != 0 and count != state.output.size())
+        throw std::runtime_error("checkpoint has the wrong number of pairs");
+
+    state.here_idxs = get_indices(in, count);
+    state.there_idxs = get_indices(in, count);
+    return loaded;
+}
@@ -0,0 +1,44 @@
+// Saving a dithering run part way through, to carry on with it later.
+//
+// A checkpoint file has everything a pipeline needs to pick up at the end of
+// a pass of dithering: which stage it was in, the output pixels, the counts,
+// the state of the random number generator, and for shuffled pairs, the order
+// of the last shuffle. It also keeps the options that the rest of the run
+// depends on, to refuse resuming with others. The input image isn't in it;
+// run the same command again, with -resume.
+//
+// The file is an 8-byte magic, then little-endian integers: 64 bits for the
+// counts and sizes, 8 bits per channel for the pixels, and 32 bits for each
+// shuffled index.
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+
+#include "permutations.hpp"
+
+
+struct checkpoint
+{
+    // The index of the dithering stage in the pipeline's list.
+    size_t stage = 0;
+
+    size_t rows = 0;
+    size_t cols = 0;
+    dither_state dither;
+
+    // The pairing strategy, its block size, and the reach of the blur.
+    pairing pairs = pairing::shuffled;
+    size_t block_size = 0;
+    int dither_radius = 1;
+};
+
+// Write a checkpoint. The file is replaced whole, by writing a temporary file
+// next to it and renaming that, so an interrupted save leaves the last one.
+void save_checkpoint(checkpoint const & saved, std::string const & filename);
+
+// Read a checkpoint written by `save_checkpoint`, or throw.
+checkpoint load_checkpoint(std::string const & filename);
+
+#endif
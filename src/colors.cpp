@@ -1,12 +1,17 @@
 #include "colors.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <random>
 #include <vector>
 
 #include "hilbert.hpp"
+#include "parallel.hpp"
 
 
 rgb::rgb(unsigned value) noexcept
@@ -43,6 +48,61 @@ std::ostream & operator<<(std::ostream & out, rgb const & color)
 }
 
 
+namespace {
+
+// The index along the Hilbert curve of sample `i` of a palette.
+//
+// We want to avoid aliasing. Counting through the colors in order has the blue
+// channel as the least-significant digits, so taking every n colors will tend
+// to simply quantize the blue channel, leaving the others unchanged.
+//
+// Also, we want to guarantee some notion of "evenly spaced." Simply randomly
+// sampling the colors could lead to some colors being randomly
+// overrepresented. Honestly, this is probably not a real issue.
+//
+// The best way to do this might be to generate 3D blue noise in the color
+// space for `(palette_size % rgb::num_colors)` samples. That would be
+// evenly-spaced and not aliased, but it also sounds like a lot of work.
+//
+// Instead, we'll evenly sample along the Hilbert curve through the color
+// space. That will at least guarantee that we're not always slicing along one
+// axis of the space.
+unsigned hilbert_sample(size_t i, size_t palette_size)
+{
+    if (palette_size == rgb::num_colors)
+        return static_cast<unsigned>(i);
+
+    // The math works such that, for the last sample, we just manually select
+    // the last color. This means that `palette_size` must be at least two,
+    // which would return the first and last colors.
+    if (i == palette_size - 1)
+        return rgb::num_colors - 1;
+
+    double const delta = rgb::num_colors / static_cast<double>(palette_size - 1);
+    return static_cast<unsigned>(static_cast<double>(i) * delta);
+}
+
+
+// Decode samples [begin, end) of a palette into `colors`, a block at a time.
+// The first sample goes to `colors[0]`.
+void decode_samples(size_t begin, size_t end, size_t palette_size, rgb * colors)
+{
+    constexpr size_t block_size = 1024;
+    std::array<unsigned, block_size> indices {};
+
+    for (auto block = begin; block < end; block += block_size)
+    {
+        auto const count = std::min(block_size, end - block);
+        for (size_t i = 0; i < count; i++)
+            indices[i] = hilbert_sample(block + i, palette_size);
+
+        hilbert_decode(indices.data(), count, colors + (block - begin));
+    }
+}
+
+} // anonymous namespace
+
+
 std::vector<rgb> make_palette(size_t palette_size)
 {
     std::vector<rgb> colors;
@@ -59,36 +119,40 @@ std::vector<rgb> make_palette(size_t palette_size)
     }
 
     // If we want to subsample or oversample the color space, that's a bit
-    // trickier.
-    //
-    // We want to avoid aliasing. The `colors` as generated above count up with
-    // the blue channel as the least-significant digits, so taking every n
-    // colors will tend to simply quantize the blue channel, leaving the others
-    // unchanged.
-    //
-    // Also, we want to guarantee some notion of "evenly spaced." Simply
-    // randomly sampling the colors could lead to some colors being randomly
-    // overrepresented. Honestly, this is probably not a real issue.
-    //
-    // The best way to do this might be to generate 3D blue noise in the color
-    // space for `(palette_size % rgb::num_colors)` samples. That would be
-    // evenly-spaced and not aliased, but it also sounds like a lot of work.
-    //
-    // Instead, we'll evenly sample along the Hilbert curve through the color
-    // space. That will at least guarantee that we're not always slicing along
-    // one axis of the space.
-    double const delta = rgb::num_colors / static_cast<double>(palette_size - 1);
-    for (size_t i = 0; i < palette_size - 1; i++)
-    {
-        auto hilbert_idx = static_cast<unsigned>(static_cast<double>(i) * delta);
-        colors.push_back(hilbert_decode(hilbert_idx));
-    }
+    // trickier; see `hilbert_sample`.
+    colors.resize(palette_size);
+    decode_samples(0, palette_size, palette_size, colors.data());
+    return colors;
+}
 
-    // The math works such that, for the last sample, we just manually select
-    // the last color. This means that `palette_size` must be at least two, which
-    // would return the first and last colors.
-    colors.push_back(hilbert_decode(rgb::num_colors - 1));
 
+rgb palette_color(size_t palette_size, size_t i)
+{
+    if (palette_size == rgb::num_colors)
+        return rgb {static_cast<unsigned>(i)};
+
+    rgb color {0};
+    decode_samples(i, i + 1, palette_size, &color);
+    return color;
+}
+
+
+std::vector<rgb> make_hilbert_palette(size_t palette_size, unsigned threads)
+{
+    std::vector<rgb> colors(palette_size);
+    parallel_for(threads, palette_size, [&](unsigned, size_t begin, size_t end) {
+        decode_samples(begin, end, palette_size, colors.data() + begin);
+    });
+
+    return colors;
+}
+
+
+std::vector<rgb>
+make_hilbert_palette_slice(size_t palette_size, size_t begin, size_t end)
+{
+    std::vector<rgb> colors(end - begin);
+    decode_samples(begin, end, palette_size, colors.data());
     return colors;
 }
 
@@ -210,6 +274,213 @@ float diff2(lab const & lhs, lab const & rhs)
 }
 
 
+namespace {
+
+// The three channels of the four colors of `fast_lab`, one channel after
+// another. The loops over these have no branches, and each lane stays in its
+// place, so they vectorize.
+using lanes = std::array<float, 12>;
+
+
+float from_bits(int32_t bits) noexcept
+{
+    float value = 0;
+    std::memcpy(&value, &bits, sizeof value);
+    return value;
+}
+
+
+int32_t to_bits(float value) noexcept
+{
+    int32_t bits = 0;
+    std::memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+
+
+// `condition ? if_true : if_false`, without a branch. Compilers won't do this
+// themselves, since comparing floats might trap, and then the loops above
+// wouldn't vectorize.
+float select(bool condition, float if_true, float if_false) noexcept
+{
+    auto const mask = -static_cast<int32_t>(condition);
+    return from_bits((to_bits(if_true) & mask) | (to_bits(if_false) & ~mask));
+}
+
+
+// log2 of a positive, normal float. Split off the exponent, so the mantissa m
+// is in [sqrt(1/2), sqrt(2)), then sum the series for
+// ln(m) = 2 atanh((m - 1) / (m + 1)), which converges quickly there.
+float approx_log2(float x) noexcept
+{
+    constexpr int32_t mantissa_bits = 0x007FFFFF;
+    constexpr int32_t one_bits = 0x3F800000;
+    auto const bits = to_bits(x);
+    auto exponent = static_cast<float>((bits >> 23) - 127);
+    auto mantissa = from_bits((bits & mantissa_bits) | one_bits);
+
+    auto const high = mantissa > 1.41421356F;
+    mantissa = select(high, mantissa * 0.5F, mantissa);
+    exponent = select(high, exponent + 1.0F, exponent);
+
+    auto const s = (mantissa - 1.0F) / (mantissa + 1.0F);
+    auto const s2 = s * s;
+    auto const series =
+        1.0F + s2 * (1.0F / 3 + s2 * (1.0F / 5 + s2 * (1.0F / 7 + s2 * (1.0F / 9))));
+    constexpr float log2_e = 1.44269504F;
+    return exponent + 2.0F * s * series * log2_e;
+}
+
+
+// 2^x for x in [-126, 127]. Split off the nearest integer, so the rest is in
+// [-1/2, 1/2], where a Taylor series of degree six is accurate to 1e-7.
+float approx_exp2(float x) noexcept
+{
+    auto const whole = static_cast<int32_t>(x + 128.5F) - 128;
+    auto const f = (x - static_cast<float>(whole)) * 0.693147181F;
+    auto const series =
+        1.0F +
+        f * (1.0F +
+             f * (1.0F / 2 +
+                  f * (1.0F / 6 +
+                       f * (1.0F / 24 + f * (1.0F / 120 + f * (1.0F / 720))))));
+    return series * from_bits((whole + 127) << 23);
+}
+
+
+// The cube root of a positive, normal float: a guess from dividing the
+// exponent by three, then Newton's method.
+float approx_cbrt(float x) noexcept
+{
+    auto root = from_bits(to_bits(x) / 3 + 0x2A5137A0);
+    root = (2.0F * root + x / (root * root)) * (1.0F / 3);
+    root = (2.0F * root + x / (root * root)) * (1.0F / 3);
+    return (2.0F * root + x / (root * root)) * (1.0F / 3);
+}
+
+} // anonymous namespace
+
+
+std::array<lab, 4> fast_lab(std::array<rgb_float, 4> const & colors) noexcept
+{
+    // This follows `xyz {rgb_float}` and `lab {xyz}`, for all four at once.
+    lanes channels {};
+    for (size_t i = 0; i < 4; i++)
+    {
+        channels[i] = colors[i].r;
+        channels[i + 4] = colors[i].g;
+        channels[i + 8] = colors[i].b;
+    }
+
+    for (auto & c: channels)
+    {
+        c *= 1.0F / 255;
+        auto const curve = approx_exp2(2.4F * approx_log2((c + 0.055F) / 1.055F));
+        c = 100 * select(c > 0.04045F, curve, c / 12.92F);
+    }
+
+    lanes ratios {};
+    for (size_t i = 0; i < 4; i++)
+    {
+        auto const r = channels[i];
+        auto const g = channels[i + 4];
+        auto const b = channels[i + 8];
+        ratios[i] = (r * 0.4124F + g * 0.3576F + b * 0.1805F) / 95.047F;
+        ratios[i + 4] = (r * 0.2126F + g * 0.7152F + b * 0.0722F) / 100.000F;
+        ratios[i + 8] = (r * 0.0193F + g * 0.1192F + b * 0.9505F) / 108.883F;
+    }
+
+    for (auto & c: ratios)
+    {
+        // Black has no cube root here, but that lane takes the line.
+        auto const root = approx_cbrt(c);
+        c = select(c > 0.008856F, root, (7.787F * c) + 16.0F / 116.0F);
+    }
+
+    std::array<lab, 4> result {};
+    for (size_t i = 0; i < 4; i++)
+    {
+        auto const x = ratios[i];
+        auto const y = ratios[i + 4];
+        auto const z = ratios[i + 8];
+        result[i].L = (116.0F * y) - 16.0F;
+        result[i].a = 500.0F * (x - y);
+        result[i].b = 200.0F * (y - z);
+    }
+
+    return result;
+}
+
+
+lab16::lab16(lab const & color) noexcept
+    : L {static_cast<int16_t>(std::lround(color.L * scale))}
+    , a {static_cast<int16_t>(std::lround(color.a * scale))}
+    , b {static_cast<int16_t>(std::lround(color.b * scale))}
+{ }
+
+
+lab16::operator lab() const noexcept
+{
+    lab color {};
+    color.L = static_cast<float>(L) / scale;
+    color.a = static_cast<float>(a) / scale;
+    color.b = static_cast<float>(b) / scale;
+    return color;
+}
+
+
+namespace {
+
+std::atomic<bool> lab_table_built {false};
+
+} // anonymous namespace
+
+
+lab_table const & lab_table::instance()
+{
+    static lab_table const table;
+    return table;
+}
+
+
+bool lab_table::is_built() noexcept
+{
+    return lab_table_built;
+}
+
+
+lab_table::lab_table() : table(rgb::num_colors)
+{
+    // The conversion to `xyz` linearizes each channel independently, so there
+    // are only 256 distinct results from the `std::pow` calls there. Compute
+    // them once, then follow exactly the same arithmetic as `xyz {rgb_float}`
+    // so that the table matches the direct conversion.
+    std::array<double, 256> linear {};
+    for (size_t i = 0; i < linear.size(); i++)
+    {
+        auto c = static_cast<double>(i) / 255.0;
+        c = (c > 0.04045) ? std::pow((c + 0.055) / 1.055, 2.4) : (c / 12.92);
+        linear[i] = c * 100;
+    }
+
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        rgb const color {static_cast<unsigned>(i)};
+        auto const r = linear[color.r];
+        auto const g = linear[color.g];
+        auto const b = linear[color.b];
+
+        xyz point {};
+        point.x = r * 0.4124 + g * 0.3576 + b * 0.1805;
+        point.y = r * 0.2126 + g * 0.7152 + b * 0.0722;
+        point.z = r * 0.0193 + g * 0.1192 + b * 0.9505;
+        table[i] = lab {point};
+    }
+
+    lab_table_built = true;
+}
+
+
 color_transform color_transform::make_random(rng_type & rng)
 {
     color_transform transform;
@@ -34,6 +34,18 @@ std::ostream & operator<<(std::ostream & out, rgb const & color);
 // be gaps or repetitions.
 std::vector<rgb> make_palette(size_t palette_size);
 
+// Get color `i` of `make_palette(palette_size)`, without making the rest.
+rgb palette_color(size_t palette_size, size_t i);
+
+// Get the same colors as `make_palette`, but in the order of the Hilbert curve
+// through the RGB colorspace, as if sorted by `hilbert_compare`. This decodes
+// each color straight from its place on the curve, on up to `threads` threads.
+std::vector<rgb> make_hilbert_palette(size_t palette_size, unsigned threads = 1);
+
+// Get colors [begin, end) of `make_hilbert_palette(palette_size)`.
+std::vector<rgb>
+make_hilbert_palette_slice(size_t palette_size, size_t begin, size_t end);
+
 
 // Check if all 2^24 RGB colors are present once, and only once.
 bool has_all_colors(std::vector<rgb> const & pixels);
@@ -111,6 +123,34 @@ std::ostream & operator<<(std::ostream & out, lab const & color);
 float diff2(lab const & lhs, lab const & rhs);
 
 
+// Convert four colors to CIELAB at once, in single precision.
+//
+// This is for colors that can't be looked up in `lab_table`, like the blurred
+// pixels of the dithering loop. It replaces the `std::pow` calls with
+// polynomials and Newton's method, in loops over the four colors that the
+// compiler turns into vector instructions. Each component is within
+// `fast_lab_tolerance` of `lab {rgb_float}`, for channels in [0, 255].
+std::array<lab, 4> fast_lab(std::array<rgb_float, 4> const & colors) noexcept;
+
+constexpr float fast_lab_tolerance = 0.001F;
+
+
+// CIELAB in 16-bit fixed point, for when memory bandwidth matters more than
+// precision. The resolution is 1/128, far below a perceptible difference.
+struct lab16
+{
+    static constexpr float scale = 128.0F;
+
+    lab16() noexcept = default;
+    explicit lab16(lab const &) noexcept;
+
+    // Widening back to floating point is exact, so allow it implicitly.
+    operator lab() const noexcept; // NOLINT
+
+    int16_t L, a, b;
+};
+
+
 // The CIEXYZ colorspace is used as an intermediate step in conversions
 // between RGB and LAB.
 struct xyz
@@ -123,6 +163,34 @@ struct xyz
 };
 
 
+// The CIELAB value of every 8-bit RGB color, precomputed.
+//
+// There are only 2^24 RGB colors, so once this table exists, converting an
+// image to CIELAB is a single gather instead of six `std::pow` calls per
+// pixel. The table is 192 MiB and takes about as long to build as converting
+// an image of 2^23 pixels, so it's only worth it for large images.
+class lab_table
+{
+public:
+    // Get the shared table, building it on first use.
+    static lab_table const & instance();
+
+    // Return true if `instance` has already been called.
+    static bool is_built() noexcept;
+
+    // Identical (bit for bit) to `lab{color}`.
+    lab const & operator[](rgb color) const noexcept
+    {
+        return table[unsigned(color)];
+    }
+
+private:
+    lab_table();
+
+    std::vector<lab> table;
+};
+
+
 // A map from one RGB color space to another.
 //
 // If you think of the RGB values as coordinate triplets, there are 48 ways to
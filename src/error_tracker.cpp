@@ -0,0 +1,78 @@
+#include "error_tracker.hpp"
+
+#include <cmath>
+
+
+namespace {
+
+constexpr double error_scale = 1U << 16U;
+
+int64_t to_fixed(float diff_squared)
+{
+    return std::llround(static_cast<double>(diff_squared) * error_scale);
+}
+
+} // anonymous namespace
+
+
+void swap_tally::record(
+    float before_here, float before_there, float after_here, float after_there)
+{
+    swaps++;
+    error_delta += to_fixed(after_here) + to_fixed(after_there) -
+        to_fixed(before_here) - to_fixed(before_there);
+}
+
+
+swap_tally & swap_tally::operator+=(swap_tally const & rhs)
+{
+    swaps += rhs.swaps;
+    error_delta += rhs.error_delta;
+    return *this;
+}
+
+
+double pass_report::swap_rate() const
+{
+    return static_cast<double>(swaps) / static_cast<double>(num_pixels);
+}
+
+
+double pass_report::rms() const
+{
+    return std::sqrt(total_error / static_cast<double>(num_pixels));
+}
+
+
+error_tracker::error_tracker(size_t num_pixels) : num_pixels {num_pixels}
+{ }
+
+
+void error_tracker::add_pixel(float diff_squared)
+{
+    total += to_fixed(diff_squared);
+}
+
+
+pass_report error_tracker::finish_pass(swap_tally const & tally)
+{
+    total += tally.error_delta;
+    last_swaps = tally.swaps;
+    total_swaps += tally.swaps;
+    passes++;
+    return report();
+}
+
+
+void error_tracker::resume(int finished_passes, size_t swaps_so_far)
+{
+    passes = finished_passes;
+    total_swaps = swaps_so_far;
+}
+
+
+pass_report error_tracker::report() const
+{
+    auto const total_error = static_cast<double>(total) / error_scale;
+    return {passes - 1, last_swaps, total_swaps, num_pixels, total_error};
+}
@@ -0,0 +1,94 @@
+// Tracking how closely an output image matches its input as pixels swap.
+//
+// The swap engines already compute the squared error of each pixel before and
+// after a candidate swap, so keeping a running total costs O(1) per accepted
+// swap, instead of converting and summing the whole image to report it.
+//
+// Errors are kept in 64-bit fixed point, so that sums of them are exact: the
+// running total is the same as summing the image again, whatever order
+// updates arrive in, and whichever thread makes them. Summing 2^24 floats
+// into a float, on the other hand, loses most of the precision.
+
+#ifndef ERROR_TRACKER_HPP
+#define ERROR_TRACKER_HPP
+
+#include <cstdint>
+#include <functional>
+
+
+// Swaps made over some part of a pass, and how much they changed the total
+// error. Each thread keeps its own.
+struct swap_tally
+{
+    // Record a swap that changed the squared errors of two pixels from
+    // `before_here` and `before_there` to `after_here` and `after_there`.
+    void record(
+        float before_here, float before_there, float after_here, float after_there);
+
+    swap_tally & operator+=(swap_tally const & rhs);
+
+    size_t swaps = 0;
+    int64_t error_delta = 0;
+};
+
+
+// How a swap engine stands at the end of a pass.
+struct pass_report
+{
+    // Passes count from zero for each run of an engine.
+    int pass;
+
+    // Swaps made in this pass, and in every pass so far.
+    size_t swaps;
+    size_t total_swaps;
+
+    size_t num_pixels;
+
+    // The sum over all pixels of the squared CIELAB difference between input
+    // and output.
+    double total_error;
+
+    // How long the pass took, from its start to its report, and how much of
+    // that went to choosing its pairs: shuffling, or the next round of blocks.
+    // The engines fill these in; the tracker leaves them at zero.
+    double seconds = 0;
+    double shuffle_seconds = 0;
+
+    // The fraction of pixels that swapped in this pass.
+    double swap_rate() const;
+
+    // The root-mean-square error between the input and output pixels.
+    double rms() const;
+};
+
+using progress_callback = std::function<void(pass_report const &)>;
+
+
+class error_tracker
+{
+public:
+    explicit error_tracker(size_t num_pixels);
+
+    // Add the squared error of one pixel to the initial total.
+    void add_pixel(float diff_squared);
+
+    // Apply the swaps of a finished pass, and report on it.
+    pass_report finish_pass(swap_tally const & tally);
+
+    // Report on the last finished pass, or with `pass` at -1 before the first.
+    pass_report report() const;
+
+    // Carry on counting from an earlier run, which finished `finished_passes`
+    // passes and made `swaps_so_far` swaps. The errors still come from
+    // `add_pixel`.
+    void resume(int finished_passes, size_t swaps_so_far);
+
+private:
+    size_t const num_pixels;
+    int64_t total = 0;
+    size_t last_swaps = 0;
+    size_t total_swaps = 0;
+    int passes = 0;
+};
+
+#endif
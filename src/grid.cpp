@@ -1,10 +1,11 @@
 #include "grid.hpp"
 
+#include <algorithm>
 #include <array>
-#include <deque>
-#include <queue>
+#include <cmath>
 #include <random>
-#include <stack>
+
+#include "parallel.hpp"
 
 
 namespace {
@@ -28,6 +29,39 @@ constexpr bool has_bit_set(uint8_t n, uint8_t b)
     return (n & (1U << b)) != 0;
 }
 
+
+// One step in each direction, as a change in row and column. Like the jump
+// table, these rely on unsigned wraparound.
+constexpr std::array<size_t, 4> row_step {-1UL, 0, 1, 0};
+constexpr std::array<size_t, 4> col_step {0, 1, 0, -1UL};
+
+
+// The states of a node while building the spanning tree.
+//
+// A `loose` node needs a new random direction before a walk leaves it. A
+// `committed` node keeps its direction for the next walk to pass through.
+// An `escaping` node leads out of the region being spanned, and an `in_tree`
+// node leads to the root.
+constexpr uint8_t loose = 0;
+constexpr uint8_t committed = 1;
+constexpr uint8_t escaping = 2;
+constexpr uint8_t in_tree = 3;
+
+
+// Span the grid in square tiles, starting at this size, and growing by this
+// factor until a tile covers the whole grid.
+constexpr size_t first_tile_size = 64;
+constexpr size_t tile_growth = 4;
+
+
+// A tile of nodes to span, with its own random stream.
+struct tile
+{
+    size_t row_begin, row_end;
+    size_t col_begin, col_end;
+    grid_graph::rng_type rng;
+};
+
 } // anonymous namespace
 
 
@@ -43,18 +77,19 @@ void grid_graph::node_t::set_edge(uint8_t direction)
 }
 
 
-grid_graph::grid_graph(size_t rows, size_t cols, rng_type & rng)
-    : nodes {rows * cols, {false, 0, 0}}
+grid_graph::grid_graph(size_t rows, size_t cols, rng_type & rng, unsigned threads)
+    : nodes {rows * cols, {loose, 0, 0}}
     , rows {rows}
     , cols {cols}
     , root {0}
     , jump {}
     , neighbors {}
 {
+    check_pixel_index(nodes.size());
     init_node_edges();
     init_jump_table();
     init_neighbors_table();
-    span(rng);
+    span(rng, threads);
     link_children();
 }
 
@@ -117,46 +152,128 @@ void grid_graph::init_neighbors_table()
 }
 
 
-void grid_graph::span(rng_type & rng)
+/* This is Wilson's algorithm: connect each node to the tree with a random
+ * walk, erasing any loops. Another way to see it is "cycle popping": every
+ * node points in a random direction, and while those pointers form a cycle,
+ * give each node on the cycle a new random direction. Once there are no
+ * cycles, the pointers form a uniform random spanning tree. Strangely enough,
+ * the order in which you pop cycles doesn't matter!
+ *
+ * That allows working in parallel. First, pop only the cycles that lie within
+ * small tiles of the grid, all at once. Then do the same for tiles four times
+ * larger, and so on, and finally for the whole grid. The early walks of
+ * Wilson's algorithm are long, looping journeys in search of a tiny tree; in
+ * tiles, most of those loops are erased in parallel, and with good locality.
+ * Paths that lead out of a tile keep their directions, so that later walks
+ * follow them instead of drawing new ones. The result is still uniform, and
+ * each tile has its own stream, so it doesn't depend on the number of threads.
+ */
+void grid_graph::span(rng_type & rng, unsigned threads)
 {
-    std::uniform_int_distribution<size_t> d12(0, 11);
     std::uniform_int_distribution<size_t> rnd_node(0, nodes.size() - 1);
 
     // Make a random node the root of the tree; mark it as in the tree.
     root = rnd_node(rng);
-    nodes[root].in_tree = true;
+    nodes[root].state = in_tree;
 
-    // For each node, connect it to the existing tree with a random walk.
-    // Strangely enough, the order which you add nodes to the tree doesn't
-    // affect the random properties of the final tree!
-    for (size_t start = 0; start < nodes.size(); start++)
+    for (auto tile_size = first_tile_size; tile_size < std::max(rows, cols);
+         tile_size *= tile_growth)
     {
-        // Do a random walk until you connect to the existing tree, recording
-        // the direction to the next node (the parent) as you go. Note that the
-        // random walk will move in cycles sometimes, overwriting previous
-        // parent info: that's OK.
-        auto here = start;
-        while (not nodes[here].in_tree)
+        std::vector<tile> tiles;
+        for (size_t row = 0; row < rows; row += tile_size)
         {
-            uint8_t possible = nodes[here].edges;
-            uint8_t parent_dir = neighbors[possible][d12(rng)];
-            nodes[here].dir = parent_dir;
-            here += jump[parent_dir];
+            for (size_t col = 0; col < cols; col += tile_size)
+            {
+                auto const row_end = std::min(row + tile_size, rows);
+                auto const col_end = std::min(col + tile_size, cols);
+                tiles.push_back({row, row_end, col, col_end, rng});
+                rng.jump();
+            }
         }
 
-        //  After a walk connects to the tree, go back and trace from the first
-        //  node to the tree, following the parent directions, marking these
-        //  nodes as now in the tree. Any loops/cycles are effectively removed
-        //  in this step, because only the final parent direction is followed.
-        here = start;
-        while (not nodes[here].in_tree)
+        parallel_for(threads, tiles.size(), [&](unsigned, size_t begin, size_t end) {
+            for (auto t = begin; t < end; t++)
+            {
+                auto & tl = tiles[t];
+                span_region(tl.row_begin, tl.row_end, tl.col_begin, tl.col_end, tl.rng);
+            }
+        });
+    }
+
+    span_region(0, rows, 0, cols, rng);
+}
+
+
+void grid_graph::span_region(
+    size_t row_begin, size_t row_end, size_t col_begin, size_t col_end, rng_type & rng)
+{
+    auto const inside = [&](size_t row, size_t col) {
+        return row_begin <= row and row < row_end and col_begin <= col and
+            col < col_end;
+    };
+
+    // Choose one of the twelve entries in a row of the neighbors table. The
+    // bias of this multiply-shift is below 2^-28, which doesn't matter here.
+    auto const d12 = [&]() { return ((rng() >> 32U) * 12U) >> 32U; };
+
+    for (auto row = row_begin; row < row_end; row++)
+    {
+        for (auto col = col_begin; col < col_end; col++)
         {
-            nodes[here].in_tree = true;
-            here += jump[nodes[here].dir];
+            auto const start = row * cols + col;
+            if (nodes[start].state == in_tree or nodes[start].state == escaping)
+                continue;
+
+            // Do a random walk until you connect to the existing tree, or leave
+            // the region, recording the direction to the next node (the parent)
+            // as you go. Note that the random walk will move in cycles
+            // sometimes, overwriting previous parent info: that's OK.
+            auto here = start;
+            auto here_row = row;
+            auto here_col = col;
+            uint8_t outcome = escaping;
+            while (inside(here_row, here_col))
+            {
+                auto & node = nodes[here];
+                if (node.state == in_tree or node.state == escaping)
+                {
+                    outcome = node.state;
+                    break;
+                }
+
+                if (node.state == committed)
+                    node.state = loose;
+                else
+                    node.dir = neighbors[node.edges][d12()];
+
+                here += jump[node.dir];
+                here_row += row_step[node.dir];
+                here_col += col_step[node.dir];
+            }
+
+            // After a walk ends, go back and trace from the first node,
+            // following the parent directions, marking these nodes with how
+            // the walk ended. Any loops/cycles are effectively removed in this
+            // step, because only the final parent direction is followed.
+            here = start;
+            here_row = row;
+            here_col = col;
+            while (inside(here_row, here_col) and nodes[here].state == loose)
+            {
+                auto & node = nodes[here];
+                node.state = outcome;
+                here += jump[node.dir];
+                here_row += row_step[node.dir];
+                here_col += col_step[node.dir];
+            }
         }
     }
 
-    link_children();
+    // Paths out of this region may still form cycles in a larger one.
+    for (auto row = row_begin; row < row_end; row++)
+        for (auto col = col_begin; col < col_end; col++)
+            if (nodes[row * cols + col].state == escaping)
+                nodes[row * cols + col].state = committed;
 }
 
 
@@ -187,89 +304,242 @@ void grid_graph::link_children()
 }
 
 
-std::vector<size_t> grid_graph::dfs() const
+size_t grid_graph::children(size_t idx, std::array<pixel_index, 4> & kids) const
+{
+    // Visit the children from left to up, as a stack of them would be popped.
+    size_t num_kids = 0;
+    for (auto dir = directions.rbegin(); dir != directions.rend(); dir++)
+        if (nodes[idx].get_edge(*dir))
+            kids[num_kids++] = static_cast<pixel_index>(idx + jump[*dir]);
+
+    return num_kids;
+}
+
+
+size_t grid_graph::path_capacity() const
 {
-    std::vector<size_t> order;
-    std::stack<size_t> unprocessed;
-    unprocessed.push(root);
+    // Paths through a random spanning tree of a grid grow as about the 5/4
+    // power of the distance they cover: at 4096x4096, the tallest subtree is
+    // about 64000 nodes, a little under 8192^1.25. The stack grows past this if
+    // it has to.
+    auto const span = static_cast<double>(rows + cols);
+    return std::min(nodes.size(), static_cast<size_t>(std::pow(span, 1.25)));
+}
+
+
+namespace {
+
+// One level of a depth-first search: a node, its children in the order to
+// visit them, and the next of those to visit. Each node's children are found,
+// and sorted, once, when the search reaches it. The path holds every node from
+// the root down, so this is kept small.
+struct frame
+{
+    explicit frame(size_t idx) : idx {static_cast<pixel_index>(idx)}
+    { }
+
+    pixel_index idx;
+    uint8_t num_kids = 0;
+    uint8_t next_kid = 0;
+    std::array<pixel_index, 4> kids {};
 
-    while (not unprocessed.empty())
+    bool done() const
     {
-        auto idx = unprocessed.top();
-        unprocessed.pop();
-        order.push_back(idx);
+        return next_kid == num_kids;
+    }
 
-        for (auto const dir: directions)
-            if (nodes[idx].get_edge(dir))
-                unprocessed.push(idx + jump[dir]);
+    size_t next()
+    {
+        return kids[next_kid++];
     }
+};
+
+} // anonymous namespace
+
 
+std::vector<pixel_index> grid_graph::dfs() const
+{
+    std::vector<pixel_index> order;
+    order.reserve(nodes.size());
+    visit_dfs([&](size_t idx) { order.push_back(static_cast<pixel_index>(idx)); });
     return order;
 }
 
 
-std::vector<size_t> grid_graph::sdfs() const
+std::vector<pixel_index> grid_graph::sdfs() const
 {
-    auto order = dfs();
+    std::vector<pixel_index> order;
+    order.reserve(nodes.size());
+    visit_sdfs([&](size_t idx) { order.push_back(static_cast<pixel_index>(idx)); });
+    return order;
+}
 
-    // Record the height at every node by working up from the leaves.
-    std::vector<int> heights(rows * cols);
-    while (not order.empty())
-    {
-        auto idx = order.back();
-        order.pop_back();
 
-        int height = 0;
-        for (auto const dir: directions)
-            if (nodes[idx].get_edge(dir))
-                height = std::max(height, heights[idx + jump[dir]] + 1);
+std::vector<pixel_index> grid_graph::bfs() const
+{
+    std::vector<pixel_index> order;
+    order.reserve(nodes.size());
+    visit_bfs([&](size_t idx) { order.push_back(static_cast<pixel_index>(idx)); });
+    return order;
+}
 
-        heights[idx] = height;
+
+void grid_graph::visit_dfs(visitor const & visit) const
+{
+    // Keep only the path from the root to the current node on the stack, so
+    // that it's never deeper than the tree.
+    std::vector<frame> path;
+    path.reserve(path_capacity());
+    auto const enter = [&](size_t idx) {
+        visit(idx);
+        auto & entered = path.emplace_back(idx);
+        entered.num_kids = static_cast<uint8_t>(children(idx, entered.kids));
+    };
+
+    enter(root);
+    while (not path.empty())
+    {
+        auto & top = path.back();
+        if (top.done())
+            path.pop_back();
+        else
+            enter(top.next());
     }
+}
+
 
-    std::stack<size_t> dfs_stack;
-    dfs_stack.push(root);
-    while (not dfs_stack.empty())
+std::vector<uint16_t> grid_graph::heights() const
+{
+    constexpr uint16_t max_height = UINT16_MAX;
+    std::vector<uint16_t> heights(nodes.size());
+
+    // Record the height at every node by working up from the leaves: each
+    // node's height is final once the search leaves it.
+    std::vector<frame> path;
+    path.reserve(path_capacity());
+    auto const enter = [&](size_t idx) {
+        auto & entered = path.emplace_back(idx);
+        entered.num_kids = static_cast<uint8_t>(children(idx, entered.kids));
+    };
+
+    enter(root);
+    while (not path.empty())
     {
-        auto node_idx = dfs_stack.top();
-        dfs_stack.pop();
-        order.push_back(node_idx);
+        auto & top = path.back();
+        if (not top.done())
+        {
+            enter(top.next());
+            continue;
+        }
 
-        // Build a list of up to four children.
-        std::array<size_t, 4> children {};
-        size_t num_children = 0;
-        for (auto const dir: directions)
-            if (nodes[node_idx].get_edge(dir))
-                children[num_children++] = node_idx + jump[dir];
-
-        // Sort the children in descending order of height, then put the
-        // shortest on the stack last, so that the search visits it first.
-        auto taller = [&](auto lhs, auto rhs) { return heights[lhs] > heights[rhs]; };
-        std::sort(children.begin(), children.begin() + num_children, taller);
-        for (size_t i = 0; i < num_children; i++)
-            dfs_stack.push(children[i]);
+        auto const idx = top.idx;
+        path.pop_back();
+        if (not path.empty())
+        {
+            auto & parent_height = heights[path.back().idx];
+            auto const height = std::min<unsigned>(heights[idx] + 1U, max_height);
+            parent_height = std::max(parent_height, static_cast<uint16_t>(height));
+        }
     }
 
-    return order;
+    return heights;
+}
+
+
+void grid_graph::visit_sdfs(visitor const & visit) const
+{
+    auto const height = heights();
+
+    // The path is never longer than the tree is tall.
+    std::vector<frame> path;
+    path.reserve(size_t {height[root]} + 1);
+
+    // Visit the children in ascending order of height. Among children of the
+    // same height, keep the order of `dfs`.
+    auto const shorter = [&](auto lhs, auto rhs) { return height[lhs] < height[rhs]; };
+    auto const enter = [&](size_t idx) {
+        visit(idx);
+        auto & entered = path.emplace_back(idx);
+        entered.num_kids = static_cast<uint8_t>(children(idx, entered.kids));
+        std::stable_sort(
+            entered.kids.begin(), entered.kids.begin() + entered.num_kids, shorter);
+    };
+
+    enter(root);
+    while (not path.empty())
+    {
+        auto & top = path.back();
+        if (top.done())
+            path.pop_back();
+        else
+            enter(top.next());
+    }
 }
 
 
-std::vector<size_t> grid_graph::bfs() const
+void grid_graph::visit_bfs(visitor const & visit) const
 {
-    std::vector<size_t> order;
-    std::deque<size_t> unprocessed;
-    unprocessed.push_back(root);
+    // Work through the tree one level at a time, so that only two levels are
+    // stored at once.
+    std::vector<pixel_index> level {static_cast<pixel_index>(root)};
+    std::vector<pixel_index> next_level;
 
-    while (not unprocessed.empty())
+    while (not level.empty())
     {
-        auto idx = unprocessed.front();
-        unprocessed.pop_front();
-        order.push_back(idx);
+        next_level.clear();
+        for (auto const idx: level)
+        {
+            visit(idx);
+            for (auto const dir: directions)
+                if (nodes[idx].get_edge(dir))
+                    next_level.push_back(static_cast<pixel_index>(idx + jump[dir]));
+        }
 
-        for (auto const dir: directions)
-            if (nodes[idx].get_edge(dir))
-                unprocessed.push_back(idx + jump[dir]);
+        std::swap(level, next_level);
     }
+}
 
-    return order;
+
+void grid_graph::visit(traversal order, visitor const & visit) const
+{
+    switch (order)
+    {
+    case traversal::sdfs:
+        visit_sdfs(visit);
+        return;
+    case traversal::dfs:
+        visit_dfs(visit);
+        return;
+    case traversal::bfs:
+        visit_bfs(visit);
+        return;
+    }
+}
+
+
+size_t grid_graph::parent(size_t idx) const
+{
+    return (idx == root) ? idx : idx + jump[nodes[idx].dir];
+}
+
+
+void grid_graph::set_root(size_t idx)
+{
+    // Walk up from the new root, and point each node on the way back at the
+    // one it was reached from, once its own old parent link has been read.
+    uint8_t dir = 0;
+    for (auto node = idx; node != root; )
+    {
+        auto const up = node + jump[nodes[node].dir];
+        auto const back = opposite_of(nodes[node].dir);
+        if (node != idx)
+            nodes[node].dir = dir;
+        dir = back;
+        node = up;
+    }
+    if (idx != root)
+        nodes[root].dir = dir;
+
+    root = idx;
+    link_children();
 }
@@ -10,9 +10,21 @@
 #define GRID_HPP
 
 #include <array>
+#include <cstdint>
+#include <functional>
 #include <vector>
 
 #include "XoshiroCpp.hpp"
+#include "array2d.hpp"
+
+
+// The orders in which to visit the nodes of a spanning tree.
+enum class traversal
+{
+    sdfs,
+    dfs,
+    bfs
+};
 
 
 class grid_graph
@@ -22,23 +34,42 @@ public:
     // type. But then all that code would have to live in the header file.
     using rng_type = XoshiroCpp::Xoshiro256StarStar;
 
-    // Build a random spanning tree for a grid graph with the given dimensions.
-    grid_graph(size_t rows, size_t cols, rng_type & rng);
+    // Build a random spanning tree for a grid graph with the given dimensions,
+    // on up to `threads` threads. The tree depends only on the state of `rng`,
+    // not on the number of threads.
+    grid_graph(size_t rows, size_t cols, rng_type & rng, unsigned threads = 1);
 
     // Depth-first search. Return the indices of all nodes in a preordering,
     // starting with the root, then recursively visiting any child trees
     // towards up, right, down, and left.
-    std::vector<size_t> dfs() const;
+    std::vector<pixel_index> dfs() const;
 
     // Shortest depth-first search. Return the indices of all nodes in a
     // preordering, starting with the root, and then recursively visiting the
     // (up to) four children, starting with the child tree with the smallest
     // height.
-    std::vector<size_t> sdfs() const;
+    std::vector<pixel_index> sdfs() const;
 
     // Return the indices sorted by distance from root, like a breadth-first
     // search.
-    std::vector<size_t> bfs() const;
+    std::vector<pixel_index> bfs() const;
+
+    // Call `visit` with the index of each node, in the same orders as above,
+    // without building a vector of them. The depth-first searches need memory
+    // in proportion to the height of the tree, and the breadth-first search in
+    // proportion to its widest level.
+    using visitor = std::function<void(size_t)>;
+    void visit_dfs(visitor const & visit) const;
+    void visit_sdfs(visitor const & visit) const;
+    void visit_bfs(visitor const & visit) const;
+    void visit(traversal order, visitor const & visit) const;
+
+    // Return the parent of a node, or the node itself for the root.
+    size_t parent(size_t idx) const;
+
+    // Make `idx` the root of the same tree, by turning around the parent links
+    // on the path between it and the old root.
+    void set_root(size_t idx);
 
 private:
     // Store the nodes in a row-major array.
@@ -55,8 +86,8 @@ private:
     // interface.
     struct node_t
     {
-        // A status bit indicating if the node has been added to spanning tree.
-        bool in_tree : 1;
+        // Where the node stands while building the spanning tree; see `span`.
+        uint8_t state : 2;
 
         // A two-bit integer representing a direction pointing towards the
         // parent of the node.
@@ -90,12 +121,33 @@ private:
     void init_neighbors_table();
 
     // Generate a random spanning tree.
-    void span(rng_type & rng);
+    void span(rng_type & rng, unsigned threads);
+
+    // Connect the nodes of a rectangle, [row_begin, row_end) x [col_begin,
+    // col_end), to the tree as far as possible without leaving the rectangle.
+    void span_region(
+        size_t row_begin,
+        size_t row_end,
+        size_t col_begin,
+        size_t col_end,
+        rng_type & rng);
 
     // Repurpose the `edges` members of the nodes. Each node points to its
     // parent with `dir`; add links from each node back to its children using
     // `edges`.
     void link_children();
+
+    // Collect the up to four children of a node, in the order that `dfs`
+    // visits them. Return how many there are.
+    size_t children(size_t idx, std::array<pixel_index, 4> & kids) const;
+
+    // How many levels of a depth-first search to make room for up front.
+    size_t path_capacity() const;
+
+    // The height of the subtree under each node, saturating at 2^16 - 1. Only
+    // the few longest branches of trees over about 2^24 nodes saturate, and
+    // `sdfs` visits those in `dfs` order.
+    std::vector<uint16_t> heights() const;
 };
 
 #endif
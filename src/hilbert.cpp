@@ -1,6 +1,8 @@
 #include "hilbert.hpp"
 
+#include <algorithm>
 #include <array>
+#include <vector>
 
 /* This 3D version of the Hilbert curve is (I think) a fractal. Divide a cube
  * into octants and visit them in some order. Further divide each octant into
@@ -177,6 +179,92 @@ constexpr uint8_t get_octant(rgb const & c, unsigned step)
     return octant;
 }
 
+
+/* Since `rotate` treats every bit of a channel alike, all the rotations built
+ * up while encoding act the same way on each level of octants. So the curve is
+ * a small state machine: the state is the rotation so far, and each step reads
+ * three bits, emits three bits, and moves to the rotation for the next level.
+ * Tabulating that saves walking through `rotate` for every bit of every color.
+ */
+class hilbert_machine
+{
+public:
+    struct transition
+    {
+        // The octant order, when encoding, or the octant, when decoding.
+        uint8_t digit;
+        uint8_t next;
+    };
+
+    static hilbert_machine const & instance()
+    {
+        static hilbert_machine const machine;
+        return machine;
+    }
+
+    transition encode(unsigned state, unsigned octant) const noexcept
+    {
+        return encodes[state * 8 + octant];
+    }
+
+    transition decode(unsigned state, unsigned order) const noexcept
+    {
+        return decodes[state * 8 + order];
+    }
+
+private:
+    // The 3D rotations and reflections of a cube.
+    static constexpr size_t max_states = 48;
+
+    // A rotation, stored as which octant it takes each octant to.
+    using octant_map = std::array<uint8_t, 8>;
+
+    hilbert_machine()
+    {
+        std::vector<octant_map> states {{0, 1, 2, 3, 4, 5, 6, 7}};
+        for (size_t state = 0; state < states.size(); state++)
+        {
+            for (uint8_t octant = 0; octant < 8; octant++)
+            {
+                auto const rotated = states[state][octant];
+
+                octant_map next {};
+                for (size_t i = 0; i < next.size(); i++)
+                    next[i] = rotate_octant(rotated, states[state][i]);
+
+                auto const found = std::find(states.begin(), states.end(), next);
+                auto const next_state = static_cast<uint8_t>(found - states.begin());
+                if (found == states.end())
+                    states.push_back(next);
+
+                auto const order =
+                    static_cast<uint8_t>(order_for_octant[rotated]);
+                encodes[state * 8 + octant] = {order, next_state};
+                decodes[state * 8 + order] = {octant, next_state};
+            }
+        }
+    }
+
+    // Apply `rotate(octant, ...)` to the octant `corner`. Channels that are all
+    // ones or all zeros stand for the bits of the corner.
+    static uint8_t rotate_octant(unsigned octant, uint8_t corner)
+    {
+        auto const channel = [&](unsigned bit) {
+            return static_cast<uint8_t>((corner & bit) != 0 ? 0xFFU : 0U);
+        };
+
+        rgb color {0};
+        color.r = channel(0b100U);
+        color.g = channel(0b010U);
+        color.b = channel(0b001U);
+        rotate(octant, color);
+        return get_octant(color, 0);
+    }
+
+    std::array<transition, max_states * 8> encodes {};
+    std::array<transition, max_states * 8> decodes {};
+};
+
 } // anonymous namespace
 
 
@@ -245,3 +333,54 @@ bool hilbert_compare(rgb lhs, rgb rhs)
     // All 8 bits are the same, so it's the same color.
     return false;
 }
+
+
+void hilbert_encode(rgb const * colors, size_t count, unsigned * indices)
+{
+    auto const & machine = hilbert_machine::instance();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto const c = colors[i];
+        unsigned index = 0;
+        unsigned state = 0;
+
+        for (unsigned step = 0; step < 8; step++)
+        {
+            auto const t = machine.encode(state, get_octant(c, step));
+            index = (index << 3U) | t.digit;
+            state = t.next;
+        }
+
+        indices[i] = index;
+    }
+}
+
+
+void hilbert_decode(unsigned const * indices, size_t count, rgb * colors)
+{
+    auto const & machine = hilbert_machine::instance();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto const d = indices[i];
+        unsigned r = 0;
+        unsigned g = 0;
+        unsigned b = 0;
+        unsigned state = 0;
+
+        for (unsigned step = 0; step < 8; step++)
+        {
+            auto const order = (d >> (7U - step) * 3U) & 0b111U;
+            auto const t = machine.decode(state, order);
+            r = (r << 1U) | ((t.digit >> 2U) & 1U);
+            g = (g << 1U) | ((t.digit >> 1U) & 1U);
+            b = (b << 1U) | (t.digit & 1U);
+            state = t.next;
+        }
+
+        colors[i].r = static_cast<uint8_t>(r);
+        colors[i].g = static_cast<uint8_t>(g);
+        colors[i].b = static_cast<uint8_t>(b);
+    }
+}
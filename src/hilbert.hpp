@@ -8,6 +8,8 @@
 #ifndef HILBERT_HPP
 #define HILBERT_HPP
 
+#include <cstddef>
+
 #include "colors.hpp"
 
 
@@ -23,4 +25,10 @@ rgb hilbert_decode(unsigned d);
 // colorspace.
 bool hilbert_compare(rgb lhs, rgb rhs);
 
+// Encode or decode `count` colors at once, from `colors` to `indices` or the
+// other way around. These give exactly the same results as the functions
+// above, but walk the curve with a lookup table, which is about twice as fast.
+void hilbert_encode(rgb const * colors, size_t count, unsigned * indices);
+void hilbert_decode(unsigned const * indices, size_t count, rgb * colors);
+
 #endif
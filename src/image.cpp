@@ -1,75 +1,397 @@
+#include "image.hpp"
+
+#include <algorithm>
+#include <array>
+#include <csetjmp>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <png.h>
 
 #include "array2d.hpp"
 #include "colors.hpp"
+#include "raw_image.hpp"
 
 
-array2d<rgb> load_image(char const * filename)
+static_assert(sizeof(rgb) == 3, "rows of rgb should match 8-bit PNG RGB rows");
+
+
+namespace {
+
+struct file_closer
+{
+    void operator()(std::FILE * file) const
+    {
+        std::fclose(file); // NOLINT
+    }
+};
+
+using file_ptr = std::unique_ptr<std::FILE, file_closer>;
+
+file_ptr open_file(char const * filename, char const * mode)
+{
+    file_ptr file {std::fopen(filename, mode)};
+    if (not file)
+        throw std::runtime_error(std::string {"failed to open "} + filename);
+
+    return file;
+}
+
+
+// libpng reports errors by jumping back to a `setjmp` in the function that
+// called it, skipping any destructors on the way. So each function here makes
+// all of its objects, including one of these to clean up libpng's state, before
+// calling `setjmp`.
+struct png_reader
 {
-    png_image image;
-    memset(&image, 0, (sizeof image));
-    image.version = PNG_IMAGE_VERSION;
+    png_reader()
+        : png {png_create_read_struct(
+              PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr)}
+        , info {png_create_info_struct(png)}
+    { }
 
-    auto is_png = png_image_begin_read_from_file(&image, filename);
-    if (is_png == 0)
+    png_reader(png_reader const &) = delete;
+    png_reader & operator=(png_reader const &) = delete;
+
+    ~png_reader()
+    {
+        png_destroy_read_struct(&png, &info, nullptr);
+    }
+
+    png_structp png;
+    png_infop info;
+};
+
+
+struct png_writer
+{
+    png_writer()
+        : png {png_create_write_struct(
+              PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr)}
+        , info {png_create_info_struct(png)}
+    { }
+
+    png_writer(png_writer const &) = delete;
+    png_writer & operator=(png_writer const &) = delete;
+
+    ~png_writer()
+    {
+        png_destroy_write_struct(&png, &info);
+    }
+
+    png_structp png;
+    png_infop info;
+};
+
+
+// Read the header of a PNG file, and set up libpng to convert whatever is in
+// it to 8-bit RGB: expand palettes and gray, reduce 16 bits to 8, and drop
+// any alpha channel. Return the number of interlacing passes.
+int start_reading(png_reader & reader, std::FILE * file)
+{
+    std::array<png_byte, 8> signature {};
+    if (std::fread(signature.data(), 1, signature.size(), file) != signature.size() or
+        png_sig_cmp(signature.data(), 0, signature.size()) != 0)
         throw std::runtime_error("not a PNG image");
 
-    image.format = PNG_FORMAT_RGB;
-    std::vector<png_byte> buffer(PNG_IMAGE_SIZE(image)); // NOLINT
+    png_init_io(reader.png, file);
+    png_set_sig_bytes(reader.png, static_cast<int>(signature.size()));
+    png_read_info(reader.png, reader.info);
 
-    auto finished = png_image_finish_read(
-        &image,
-        nullptr, // background
-        buffer.data(),
-        0, // row stride
-        nullptr);
+    png_set_expand(reader.png);
+    png_set_strip_16(reader.png);
+    png_set_strip_alpha(reader.png);
+    png_set_gray_to_rgb(reader.png);
+    auto const passes = png_set_interlace_handling(reader.png);
+    png_read_update_info(reader.png, reader.info);
+
+    return passes;
+}
+
+
+std::vector<png_bytep> row_pointers(array2d<rgb> & pixels)
+{
+    std::vector<png_bytep> rows(pixels.rows);
+    for (size_t row = 0; row < pixels.rows; row++)
+        rows[row] = reinterpret_cast<png_bytep>(&pixels(row, 0)); // NOLINT
+
+    return rows;
+}
+
+
+int filter_flags(png_filter filter)
+{
+    switch (filter)
+    {
+    case png_filter::adaptive:
+        return PNG_ALL_FILTERS;
+    case png_filter::none:
+        return PNG_FILTER_NONE;
+    case png_filter::sub:
+        return PNG_FILTER_SUB;
+    case png_filter::up:
+        return PNG_FILTER_UP;
+    case png_filter::average:
+        return PNG_FILTER_AVG;
+    case png_filter::paeth:
+        return PNG_FILTER_PAETH;
+    }
+
+    return PNG_ALL_FILTERS;
+}
 
-    if (finished == 0)
-        throw std::runtime_error("failed to read PNG image");
 
-    auto iter = buffer.begin();
-    array2d<rgb> retval(image.height, image.width);
-    for (auto & pixel: retval.data)
+// Write an 8-bit RGB image, getting each row, in order, from `row_at`.
+template <typename RowAt>
+void write_rows(
+    size_t rows,
+    size_t cols,
+    char const * filename,
+    png_options const & options,
+    RowAt && row_at)
+{
+    auto const file = open_file(filename, "wb");
+    png_writer writer;
+    if (writer.png == nullptr or writer.info == nullptr)
+        throw std::runtime_error("failed to write PNG image");
+
+    if (setjmp(png_jmpbuf(writer.png)) != 0) // NOLINT
+        throw std::runtime_error("failed to write PNG image");
+
+    png_init_io(writer.png, file.get());
+    png_set_compression_level(writer.png, options.compression);
+    png_set_filter(writer.png, PNG_FILTER_TYPE_BASE, filter_flags(options.filter));
+    png_set_IHDR(
+        writer.png,
+        writer.info,
+        static_cast<png_uint_32>(cols),
+        static_cast<png_uint_32>(rows),
+        8,
+        PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(writer.png, writer.info);
+
+    for (size_t row = 0; row < rows; row++)
     {
-        pixel.r = *iter++;
-        pixel.g = *iter++;
-        pixel.b = *iter++;
+        auto const * pixels = row_at(row);
+        png_write_row(writer.png, reinterpret_cast<png_const_bytep>(pixels)); // NOLINT
     }
 
+    png_write_end(writer.png, nullptr);
+}
+
+} // anonymous namespace
+
+
+bool parse_png_filter(std::string const & name, png_filter & filter)
+{
+    if (name == "adaptive")
+        filter = png_filter::adaptive;
+    else if (name == "none")
+        filter = png_filter::none;
+    else if (name == "sub")
+        filter = png_filter::sub;
+    else if (name == "up")
+        filter = png_filter::up;
+    else if (name == "average")
+        filter = png_filter::average;
+    else if (name == "paeth")
+        filter = png_filter::paeth;
+    else
+        return false;
+
+    return true;
+}
+
+
+png_options png_options::fast() noexcept
+{
+    // Writing a 4096x4096 allRGB image this way is about nine times faster
+    // than the defaults, and the file is about a fifth larger.
+    return {1, png_filter::sub};
+}
+
+
+bool png_options::valid() const noexcept
+{
+    return -1 <= compression and compression <= 9;
+}
+
+
+bool parse_png_options(
+    bool fast,
+    bool compression_given,
+    std::string const & filter_name,
+    png_options & png)
+{
+    if (fast)
+    {
+        auto const compression = png.compression;
+        png = png_options::fast();
+        if (compression_given)
+            png.compression = compression;
+    }
+
+    return (filter_name.empty() or parse_png_filter(filter_name, png.filter)) and
+        png.valid();
+}
+
+
+array2d<rgb> load_image(char const * filename)
+{
+    if (is_raw_image(filename))
+    {
+        mapped_image const raw {filename};
+        array2d<rgb> retval(raw.rows(), raw.cols());
+        std::copy_n(raw.data(), retval.size(), retval.data.begin());
+        return retval;
+    }
+
+    auto const file = open_file(filename, "rb");
+    png_reader reader;
+    if (reader.png == nullptr or reader.info == nullptr)
+        throw std::runtime_error("failed to read PNG image");
+
+    if (setjmp(png_jmpbuf(reader.png)) != 0) // NOLINT
+        throw std::runtime_error("failed to read PNG image");
+
+    start_reading(reader, file.get());
+
+    // Decode straight into the image, whether or not it's interlaced. The
+    // image has a destructor, so jump back to after it's made.
+    array2d<rgb> retval(
+        png_get_image_height(reader.png, reader.info),
+        png_get_image_width(reader.png, reader.info));
+    auto rows = row_pointers(retval);
+    if (setjmp(png_jmpbuf(reader.png)) != 0) // NOLINT
+        throw std::runtime_error("failed to read PNG image");
+
+    png_read_image(reader.png, rows.data());
+    png_read_end(reader.png, nullptr);
+
     return retval;
 }
 
 
-void write_image(array2d<rgb> const & pixels, char const * filename)
+std::pair<size_t, size_t> image_size(char const * filename)
 {
-    png_image image;
-    memset(&image, 0, (sizeof image));
-    image.version = PNG_IMAGE_VERSION;
-    image.width = static_cast<png_uint_32>(pixels.cols);
-    image.height = static_cast<png_uint_32>(pixels.rows);
-    image.format = PNG_FORMAT_RGB;
+    if (is_raw_image(filename))
+    {
+        mapped_image const raw {filename};
+        return {raw.rows(), raw.cols()};
+    }
 
-    std::vector<png_byte> buffer(PNG_IMAGE_SIZE(image)); // NOLINT
+    auto const file = open_file(filename, "rb");
+    png_reader reader;
+    if (reader.png == nullptr or reader.info == nullptr)
+        throw std::runtime_error("failed to read PNG image");
 
-    auto iter = buffer.begin();
-    for (auto const & pixel: pixels.data)
+    if (setjmp(png_jmpbuf(reader.png)) != 0) // NOLINT
+        throw std::runtime_error("failed to read PNG image");
+
+    start_reading(reader, file.get());
+    return {
+        png_get_image_height(reader.png, reader.info),
+        png_get_image_width(reader.png, reader.info)};
+}
+
+
+void read_image(
+    char const * filename, image_start const & start, row_consumer const & consume)
+{
+    // Hand out rows of a raw image straight from the mapping.
+    if (is_raw_image(filename))
+    {
+        mapped_image const raw {filename};
+        start(raw.rows(), raw.cols());
+        for (size_t r = 0; r < raw.rows(); r++)
+            consume(r, raw.row(r));
+        return;
+    }
+
+    auto const file = open_file(filename, "rb");
+    png_reader reader;
+    std::vector<rgb> row;
+    std::unique_ptr<array2d<rgb>> whole;
+    std::vector<png_bytep> rows;
+    if (reader.png == nullptr or reader.info == nullptr)
+        throw std::runtime_error("failed to read PNG image");
+
+    if (setjmp(png_jmpbuf(reader.png)) != 0) // NOLINT
+        throw std::runtime_error("failed to read PNG image");
+
+    auto const passes = start_reading(reader, file.get());
+    size_t const height = png_get_image_height(reader.png, reader.info);
+    size_t const width = png_get_image_width(reader.png, reader.info);
+    start(height, width);
+
+    // Interlaced images only have their final rows after the last pass, so
+    // those have to be read whole.
+    if (passes > 1)
+    {
+        whole = std::make_unique<array2d<rgb>>(height, width);
+        rows = row_pointers(*whole);
+        png_read_image(reader.png, rows.data());
+        for (size_t r = 0; r < height; r++)
+            consume(r, &(*whole)(r, 0));
+    }
+    else
+    {
+        row.resize(width);
+        for (size_t r = 0; r < height; r++)
+        {
+            png_read_row(reader.png, reinterpret_cast<png_bytep>(row.data()), nullptr);
+            consume(r, row.data());
+        }
+    }
+
+    png_read_end(reader.png, nullptr);
+}
+
+
+void write_image(
+    array2d<rgb> const & pixels, char const * filename, png_options const & options)
+{
+    // Write straight from the image's own storage.
+    if (is_raw_name(filename))
+    {
+        write_raw_image(pixels.rows, pixels.cols, filename, [&](size_t row) {
+            return &pixels(row, 0);
+        });
+        return;
+    }
+
+    write_rows(pixels.rows, pixels.cols, filename, options, [&](size_t row) {
+        return &pixels(row, 0);
+    });
+}
+
+
+void write_image(
+    size_t rows,
+    size_t cols,
+    row_producer const & produce,
+    char const * filename,
+    png_options const & options)
+{
+    std::vector<rgb> row(cols);
+    if (is_raw_name(filename))
     {
-        *iter++ = pixel.r;
-        *iter++ = pixel.g;
-        *iter++ = pixel.b;
+        write_raw_image(rows, cols, filename, [&](size_t r) {
+            produce(r, row.data());
+            return row.data();
+        });
+        return;
     }
 
-    auto write_complete = png_image_write_to_file(
-        &image,
-        filename,
-        0, // no need to convert to 8-bit
-        buffer.data(),
-        0, // automatically determine row stride
-        nullptr // no colormap
-    );
-
-    if (write_complete == 0)
-        throw std::runtime_error(image.message); // NOLINT
+    write_rows(rows, cols, filename, options, [&](size_t r) {
+        produce(r, row.data());
+        return row.data();
+    });
 }
@@ -1,18 +1,96 @@
 // PNG image reading via libPNG
 //
-// This is the simplest possible wrapper around libPNG's C API. Error-handling
-// is an afterthought. Here there be dragons.
+// This wraps libPNG's row-by-row C API. Images are always 8-bit RGB, which is
+// exactly the layout of `array2d<rgb>`, so whole images are decoded and encoded
+// in place, without an intermediate buffer. Error-handling is an afterthought.
+// Here there be dragons.
+//
+// Images can also be raw, as in raw_image.hpp: those are read whatever they're
+// called, and written to any name that ends in ".raw", with no compression.
 
 #ifndef IMAGE_HPP
 #define IMAGE_HPP
 
+#include <functional>
+#include <string>
+#include <utility>
+
 #include "array2d.hpp"
 #include "colors.hpp"
 
 
+// Read a whole image. Palettes and gray are expanded to RGB, 16-bit channels
+// are reduced to 8 bits, and any alpha channel is dropped.
 array2d<rgb> load_image(char const * filename);
 
-void write_image(array2d<rgb> const & pixels, char const * filename);
+// Read just the rows and columns of an image, from its header.
+std::pair<size_t, size_t> image_size(char const * filename);
+
+// Read an image one row at a time, from the top: call `start(rows, cols)`,
+// and then `consume(row, pixels)` for each row. The pixels are only valid
+// during the call. Interlaced images have to be decoded whole first.
+using image_start = std::function<void(size_t rows, size_t cols)>;
+using row_consumer = std::function<void(size_t row, rgb const * pixels)>;
+void read_image(
+    char const * filename, image_start const & start, row_consumer const & consume);
+
+// The PNG filters, which predict each byte from its neighbors before
+// compression. `adaptive` lets libpng choose one per row.
+enum class png_filter
+{
+    adaptive,
+    none,
+    sub,
+    up,
+    average,
+    paeth
+};
+
+// Parse the name of a PNG filter. Return false if it isn't one.
+bool parse_png_filter(std::string const & name, png_filter & filter);
+
+
+// How to compress written images.
+struct png_options
+{
+    // The zlib level, from 0 (no compression) to 9 (smallest), or -1 for the
+    // zlib default.
+    int compression = -1;
+    png_filter filter = png_filter::adaptive;
+
+    // Favor write speed over file size: allRGB images barely compress anyway.
+    static png_options fast() noexcept;
+
+    // Check that the compression level is in range.
+    bool valid() const noexcept;
+};
+
+// Put together the options given on a command line, in `png`: the fast preset
+// if asked for, but with the compression level taken from `png` if it was
+// given, and the filter from `filter_name` if it isn't empty. Return false if
+// the filter isn't one, or the compression level is out of range.
+bool parse_png_options(
+    bool fast,
+    bool compression_given,
+    std::string const & filter_name,
+    png_options & png);
+
+
+void write_image(
+    array2d<rgb> const & pixels, char const * filename, png_options const & = {});
+
+
+// Fill in row `row` of an image; `pixels` has room for every column.
+using row_producer = std::function<void(size_t row, rgb * pixels)>;
+
+// Write an image one row at a time, in order from the top, so that the whole
+// image never has to be in memory.
+void write_image(
+    size_t rows,
+    size_t cols,
+    row_producer const & produce,
+    char const * filename,
+    png_options const & = {});
 
 
 #endif
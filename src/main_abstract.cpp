@@ -1,5 +1,5 @@
-#include <algorithm>
 #include <iostream>
+#include <optional>
 #include <random>
 
 #include <XoshiroCpp.hpp>
@@ -8,26 +8,83 @@
 #include "array2d.hpp"
 #include "colors.hpp"
 #include "grid.hpp"
-#include "hilbert.hpp"
 #include "image.hpp"
+#include "stats.hpp"
+#include "tiled_abstract.hpp"
 
 using namespace clipp;
 
 
+namespace {
+
+// Render and write an image in tiles, a band at a time. With `check`, return
+// true if it has exactly one of each color.
+bool write_tiled(
+    tiled_abstract const & tiles,
+    size_t rows,
+    size_t cols,
+    unsigned threads,
+    bool check,
+    char const * filename,
+    png_options const & png)
+{
+    std::optional<array2d<rgb>> band;
+    size_t band_index = 0;
+    size_t band_begin = 0;
+
+    // Keep track of the colors seen so far, for `-check`, which takes a bit
+    // for every color there is.
+    std::vector<bool> seen;
+    if (check)
+        seen.resize(rgb::num_colors);
+    bool repeated = false;
+
+    write_image(rows, cols, [&](size_t row, rgb * pixels) {
+        if (not band or row == band_begin + band->rows)
+        {
+            if (band)
+            {
+                band_begin += band->rows;
+                band_index++;
+            }
+            band.emplace(tiles.band_rows(band_index), cols);
+            tiles.render_band(band_index, *band, threads);
+        }
+
+        for (size_t col = 0; col < cols; col++)
+        {
+            auto const color = (*band)(row - band_begin, col);
+            if (check)
+            {
+                repeated = repeated or seen[unsigned(color)];
+                seen[unsigned(color)] = true;
+            }
+            pixels[col] = color;
+        }
+    }, filename, png);
+
+    return rows * cols == rgb::num_colors and not repeated;
+}
+
+} // anonymous namespace
+
+
 int main(int argc, char * argv[])
 {
     size_t rows = 0;
     size_t cols = 0;
     unsigned seed = 0;
     bool cli_seed = false;
+    unsigned threads = 1;
     std::string filename;
     bool check = false;
-    enum class order
-    {
-        sdfs,
-        dfs,
-        bfs
-    };
+    size_t tile_size = 0;
+    png_options png;
+    bool fast_png = false;
+    bool cli_compression = false;
+    std::string filter_name;
+    std::string stats_name;
+    using order = ::traversal;
     order traversal = order::sdfs;
 
     clipp::group cli {
@@ -40,9 +97,30 @@ int main(int argc, char * argv[])
             option("-dfs").set(traversal, order::dfs) % "depth first" |
             option("-bfs").set(traversal, order::bfs) % "breadth first"}
             .doc("random spanning tree traversal order (default: sdfs"),
-        (option("-seed") & integer("n", seed).set(cli_seed)) % "set random seed value"};
-
-    if (not parse(argc, argv, cli))
+        (option("-seed") & integer("n", seed).set(cli_seed)) % "set random seed value",
+        (option("-threads") & integer("n", threads))
+            .doc("Number of threads for generating colors and the spanning tree "
+                 "(default: 1)"),
+        (option("-tile") & integer("n", tile_size))
+            .doc("Generate the image in n by n tiles, a row of tiles at a time, "
+                 "for images too large to fit in memory"),
+        (option("-compression") &
+         integer("0..9", png.compression).set(cli_compression))
+            .doc("zlib compression level for the output (default: zlib's own)"),
+        (option("-filter") & value("filter", filter_name))
+            .doc("PNG filter for the output: adaptive, none, sub, up, average, "
+                 "or paeth (default: adaptive)"),
+        option("-fast").set(fast_png) %
+            "write the output quickly, at the cost of a larger file",
+        (option("-stats") & value("file", stats_name))
+            .doc("Write the time taken by each phase of the run to this file: "
+                 "CSV if it ends in .csv, otherwise JSON")};
+
+    bool const parsed = bool(parse(argc, argv, cli));
+
+    bool const valid = parsed and threads > 0 and
+        parse_png_options(fast_png, cli_compression, filter_name, png);
+    if (not valid)
     {
         std::cerr << make_man_page(cli, argv[0]);
         return -1;
@@ -51,9 +129,42 @@ int main(int argc, char * argv[])
     if (not cli_seed)
         seed = std::random_device()();
 
-    // Generate the colors for the output image.
-    auto palette = make_palette(rows * cols);
-    std::sort(palette.begin(), palette.end(), hilbert_compare);
+    run_stats stats {not stats_name.empty()};
+    auto const write_stats = [&] {
+        if (stats_name.empty())
+            return;
+
+        stats.add_counter("rows", static_cast<double>(rows));
+        stats.add_counter("cols", static_cast<double>(cols));
+        stats.add_counter("threads", threads);
+        stats.write(stats_name);
+    };
+
+    if (tile_size > 0)
+    {
+        grid_graph::rng_type rng {seed};
+        bool all_colors = false;
+        {
+            // Tiles are rendered as they're written, so this is all one phase.
+            run_stats::scoped_timer const timer {stats, "render and write"};
+            tiled_abstract const tiles {
+                rows, cols, tile_size, traversal, rng, threads};
+            all_colors = write_tiled(
+                tiles, rows, cols, threads, check, filename.c_str(), png);
+        }
+
+        if (check)
+            std::cout << (all_colors ? "Has all 2^24 RGB colors\n"
+                                     : "Not one of each RGB color\n");
+        write_stats();
+        return 0;
+    }
+
+    // Generate the colors for the output image, along the Hilbert curve. Each
+    // phase's timer replaces, and so ends, the last one's.
+    std::optional<run_stats::scoped_timer> timer;
+    timer.emplace(stats, "palette");
+    auto palette = make_hilbert_palette(rows * cols, threads);
 
     grid_graph::rng_type rng {seed};
 
@@ -64,30 +175,31 @@ int main(int argc, char * argv[])
         color = transform(color);
 
     // Generate a random spanning tree across the output image pixels.
-    grid_graph graph(rows, cols, rng);
-
-    // Order the pixels with a traversal of the spanning tree.
-    std::vector<size_t> ordering;
-    if (traversal == order::bfs)
-        ordering = graph.bfs();
-    else if (traversal == order::dfs)
-        ordering = graph.dfs();
-    else
-        ordering = graph.sdfs();
-
-    // Copy the (Hilbert-ordered) pixels to the output, in the tree traversal order.
+    timer.emplace(stats, "spanning tree");
+    grid_graph graph(rows, cols, rng, threads);
+
+    // Order the pixels with a traversal of the spanning tree, copying the
+    // (Hilbert-ordered) pixels to the output as the traversal visits them.
+    timer.emplace(stats, "traversal");
     auto output = array2d<rgb>(rows, cols);
-    for (size_t i = 0; i < palette.size(); i++)
-        output.data[ordering[i]] = palette[i];
+    size_t next_color = 0;
+    auto const place = [&](size_t idx) { output.data[idx] = palette[next_color++]; };
+
+    graph.visit(traversal, place);
 
     if (check)
     {
+        timer.emplace(stats, "check");
         if (has_all_colors(output.data))
             std::cout << "Has all 2^24 RGB colors\n";
         else
             std::cout << "Not one of each RGB color\n";
     }
 
-    write_image(output, filename.c_str());
+    timer.emplace(stats, "write");
+    write_image(output, filename.c_str(), png);
+    timer.reset();
+
+    write_stats();
     return 0;
 }
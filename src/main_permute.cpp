@@ -1,12 +1,18 @@
+#include <chrono>
 #include <iostream>
 #include <random>
 
 #include <clipp.h>
 
 #include "array2d.hpp"
+#include "batch.hpp"
 #include "colors.hpp"
 #include "image.hpp"
+#include "palette_cache.hpp"
+#include "parallel.hpp"
 #include "permutations.hpp"
+#include "pipeline.hpp"
+#include "stats.hpp"
 
 using namespace clipp;
 
@@ -17,27 +23,143 @@ int main(int argc, char * argv[])
     std::string output_name;
     std::string palette_out;
     bool ascending = false;
+    int coarse_passes = 0;
     int swap_passes = 0;
     int dither_passes = 0;
+    std::string stages_list;
+    std::string checkpoint_name;
+    int checkpoint_interval = 10;
+    std::string snapshot_name;
+    int snapshot_interval = 10;
+    bool resume = false;
     unsigned seed = 0;
     bool cli_seed = false;
+    swap_options options;
+    bool pin_threads = false;
+    std::string pairs_name = "shuffled";
+    std::string until_name;
+    double until_threshold = 0;
+    double time_budget = 0;
+    png_options png;
+    bool fast_png = false;
+    bool cli_compression = false;
+    std::string filter_name;
+    std::string manifest_name;
+    std::string palette_dir;
+    std::string stats_name;
 
     clipp::group cli {
-        value("input", input_name),
-        value("output", output_name),
+        (value("input", input_name) & value("output", output_name)) |
+            ((required("-batch") & value("manifest", manifest_name)) %
+             "permute every input in the manifest, one \"input output [stages]\" "
+             "per line, spreading them over the threads; the options apply to "
+             "every job"),
         (option("-p") & value("file", palette_out)) % "dump palette to image",
         (option("-a").set(ascending))
             .doc("Match pixels in ascending order of luminance, without "
                  "regard for hue or saturation."),
+        (option("-c") & integer("passes", coarse_passes))
+            .doc("Swap groups of similar colors between small blocks if it makes "
+                 "the blocks' average colors look more like the input image: a "
+                 "cheap start for -s and -d"),
         (option("-s") & integer("passes", swap_passes))
             .doc("Swap pixels if it makes them look more like the input image. "
                  "Passes is roughly how many times it tries for each pixel"),
         (option("-d") & integer("passes", dither_passes))
             .doc("Swap pixels if it makes their neighborhood look more like "
                  "the input image, which effects color dithering."),
-        (option("-seed") & integer("n", seed).set(cli_seed)) % "set random seed value"};
+        (option("-blur") & integer("radius", options.dither_radius))
+            .doc("Radius of the blur -d compares neighborhoods with: 1 for 3x3, "
+                 "or 2 for 5x5 (default: 1)"),
+        (option("-stages") & value("list", stages_list))
+            .doc("Run these stages in order, instead of -a, -c, -s, and -d: a "
+                 "comma-separated list like a,s50,d200, for -a, then -s 50, "
+                 "then -d 200"),
+        (option("-checkpoint") & value("file", checkpoint_name))
+            .doc("While dithering, save enough to carry on later to this file"),
+        (option("-every") & integer("passes", checkpoint_interval))
+            .doc("Passes of dithering between checkpoints (default: 10)"),
+        (option("-snapshot") & value("file", snapshot_name))
+            .doc("While dithering, write the output so far to this PNG file in "
+                 "the background, every few passes, dropping snapshots rather "
+                 "than waiting for them; {pass} in the name numbers them"),
+        (option("-snapshot-every") & integer("passes", snapshot_interval))
+            .doc("Passes of dithering between snapshots (default: 10)"),
+        option("-resume").set(resume) %
+            "carry on from the -checkpoint file, with the same result as if the "
+            "run had never stopped; give the other options again",
+        (option("-palettes") & value("dir", palette_dir))
+            .doc("Keep the palettes of each size in this directory, and reuse "
+                 "them in later runs"),
+        (option("-seed") & integer("n", seed).set(cli_seed)) % "set random seed value",
+        (option("-threads") & integer("n", options.threads))
+            .doc("Number of threads for matching and swapping (default: 1). "
+                 "Dithering only runs in parallel with blocked pairs."),
+        option("-pin").set(pin_threads) %
+            "pin each thread to its own CPU, filling one NUMA node before the "
+            "next, so that the pixels a thread sets up stay in its node's memory",
+        (option("-pairs") & value("strategy", pairs_name))
+            .doc("How to choose pixels to compare when swapping: shuffled, "
+                 "blocked, or streamed (default: shuffled)"),
+        (option("-block") & integer("n", options.block_size))
+            .doc("Size of the square blocks for blocked pairs (default: 256)"),
+        (option("-cblock") & integer("n", options.coarse_block_size))
+            .doc("Size of the largest square blocks for -c, which then halve "
+                 "down to 2 (default: 8)"),
+        (option("-until") & value("swaps|rms", until_name) &
+         number("x", until_threshold))
+            .doc("Stop swapping or dithering early, once a pass swaps less than "
+                 "fraction x of the pixels, or improves the RMS error by less "
+                 "than x. Passes are then a maximum."),
+        (option("-time") & number("seconds", time_budget))
+            .doc("Stop swapping or dithering at the end of the first pass "
+                 "after this much time"),
+        (option("-compression") &
+         integer("0..9", png.compression).set(cli_compression))
+            .doc("zlib compression level for the output (default: zlib's own)"),
+        (option("-filter") & value("filter", filter_name))
+            .doc("PNG filter for the output: adaptive, none, sub, up, average, "
+                 "or paeth (default: adaptive)"),
+        option("-fast").set(fast_png) %
+            "write the output quickly, at the cost of a larger file",
+        (option("-stats") & value("file", stats_name))
+            .doc("Write the time taken by each phase of the run, and the swaps "
+                 "and error after each pass, to this file: CSV if it ends in "
+                 ".csv, otherwise JSON")};
 
-    if (not parse(argc, argv, cli))
+    options.progress = [](pass_report const & report) {
+        std::cout << "pass " << report.pass << ": " << report.swaps << '/'
+                  << report.num_pixels << ' ' << report.swap_rate()
+                  << " rms: " << report.rms() << '\n';
+    };
+
+    bool const parsed = bool(parse(argc, argv, cli));
+
+    // -a, -c, -s, and -d run in that order, and -stages replaces them.
+    std::vector<stage> stages;
+    if (ascending)
+        stages.push_back({stage::engine::ascending});
+    if (coarse_passes > 0)
+        stages.push_back({stage::engine::coarse, coarse_passes});
+    if (swap_passes > 0)
+        stages.push_back({stage::engine::swap, swap_passes});
+    if (dither_passes > 0)
+        stages.push_back({stage::engine::dither, dither_passes});
+    bool const stages_valid =
+        stages_list.empty() or (stages.empty() and parse_stages(stages_list, stages));
+
+    bool const valid = parsed and stages_valid and
+        parse_pairing(pairs_name, options.pairs) and options.threads > 0 and
+        options.block_size >= 4 and options.coarse_block_size >= 2 and
+        (options.dither_radius == 1 or options.dither_radius == 2) and
+        (until_name.empty() or until_name == "swaps" or until_name == "rms") and
+        parse_png_options(fast_png, cli_compression, filter_name, png) and
+        checkpoint_interval > 0 and snapshot_interval > 0 and
+        (not resume or not checkpoint_name.empty()) and
+        (manifest_name.empty() or
+         (palette_out.empty() and checkpoint_name.empty() and time_budget == 0 and
+          stats_name.empty() and snapshot_name.empty()));
+    if (not valid)
     {
         std::cerr << make_man_page(cli, argv[0]);
         return -1;
@@ -46,23 +168,75 @@ int main(int argc, char * argv[])
     if (not cli_seed)
         seed = std::random_device()();
 
-    auto const input = load_image(input_name.c_str());
+    set_thread_pinning(pin_threads);
+
+    if (until_name == "swaps")
+        options.min_swap_rate = until_threshold;
+    else if (until_name == "rms")
+        options.min_rms_gain = until_threshold;
+
+    if (time_budget > 0)
+    {
+        auto const budget = std::chrono::duration<double>(time_budget);
+        options.deadline = std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(budget);
+    }
+
+    if (not manifest_name.empty())
+    {
+        auto const jobs = read_manifest(manifest_name, stages);
+        batch_settings const settings {options, seed, png, palette_dir};
+        auto const failures = run_batch(jobs, settings, std::cout);
+        return failures == 0 ? 0 : 1;
+    }
+
+    run_stats stats {not stats_name.empty()};
+    auto const input = [&] {
+        run_stats::scoped_timer const timer {stats, "load"};
+        return load_image(input_name.c_str());
+    }();
+
     array2d<rgb> output(input.rows, input.cols);
-    output.data = make_palette(input.size());
+    {
+        run_stats::scoped_timer const timer {stats, "palette"};
+        output.data = palette_cache {palette_dir}.get(input.size());
 
-    if (not palette_out.empty())
-        write_image(output, palette_out.c_str());
+        if (not palette_out.empty())
+            write_image(output, palette_out.c_str(), png);
+    }
 
     permute_rng_type rng {seed};
-    std::shuffle(output.data.begin(), output.data.end(), rng);
+    {
+        run_stats::scoped_timer const timer {stats, "shuffle"};
+        std::shuffle(output.data.begin(), output.data.end(), rng);
+    }
 
-    if (ascending)
-        match_ascending(input, output);
-    if (swap_passes > 0)
-        compare_and_swap(input, output, swap_passes, rng);
-    if (dither_passes > 0)
-        compare_and_swap_dithered(input, output, dither_passes, rng);
+    // Convert the images to CIELAB once, for all the stages.
+    pipeline engines {input, output, options};
+    if (not checkpoint_name.empty())
+        engines.save_checkpoints(checkpoint_name, checkpoint_interval);
+    if (not snapshot_name.empty())
+        engines.save_snapshots(snapshot_name, snapshot_interval, png);
+    if (not stats_name.empty())
+        engines.record_stats(stats);
+
+    if (resume)
+        engines.resume(stages, load_checkpoint(checkpoint_name), rng);
+    else
+        engines.run(stages, rng);
+
+    {
+        run_stats::scoped_timer const timer {stats, "write"};
+        write_image(output, output_name.c_str(), png);
+    }
+
+    if (not stats_name.empty())
+    {
+        stats.add_counter("rows", static_cast<double>(input.rows));
+        stats.add_counter("cols", static_cast<double>(input.cols));
+        stats.add_counter("threads", options.threads);
+        stats.write(stats_name);
+    }
 
-    write_image(output, output_name.c_str());
     return 0;
 }
@@ -0,0 +1,236 @@
+#include "pairing.hpp"
+
+#include <numeric>
+#include <utility>
+
+#include "parallel.hpp"
+
+
+bool parse_pairing(std::string const & name, pairing & strategy)
+{
+    if (name == "shuffled")
+        strategy = pairing::shuffled;
+    else if (name == "blocked")
+        strategy = pairing::blocked;
+    else if (name == "streamed")
+        strategy = pairing::streamed;
+    else
+        return false;
+
+    return true;
+}
+
+
+namespace {
+
+// The SplitMix64 finalizer: a fast, well-mixed hash of 64 bits.
+constexpr uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30U)) * 0xbf58476d1ce4e5b9U;
+    x = (x ^ (x >> 27U)) * 0x94d049bb133111ebU;
+    return x ^ (x >> 31U);
+}
+
+
+// Where to cut an axis of the given `length` into blocks: at `offset`, and
+// then every `block_size` after that. Include both ends of the axis.
+std::vector<size_t> block_cuts(size_t offset, size_t length, size_t block_size)
+{
+    std::vector<size_t> cuts {0};
+    for (auto cut = offset; cut < length; cut += block_size)
+        if (cut > 0)
+            cuts.push_back(cut);
+
+    cuts.push_back(length);
+    return cuts;
+}
+
+
+// Buckets for `shuffle_indices`: enough to keep each to about 2^15 elements,
+// which fit in cache, but few enough that the table of how many elements each
+// chunk sends to each bucket stays small.
+constexpr size_t max_buckets = 1024;
+constexpr unsigned bucket_bits = 15;
+
+
+// A bucket in [0, num_buckets), from the high 32 bits of a draw. The bias is
+// at most num_buckets / 2^32.
+size_t draw_bucket(XoshiroCpp::Xoshiro256StarStar & rng, size_t num_buckets)
+{
+    return ((rng() >> 32U) * num_buckets) >> 32U;
+}
+
+} // anonymous namespace
+
+
+void shuffle_indices(
+    std::vector<pixel_index> & idxs,
+    shuffle_scratch & scratch,
+    XoshiroCpp::Xoshiro256StarStar & rng,
+    unsigned threads)
+{
+    auto const size = idxs.size();
+    auto const num_buckets = std::clamp<size_t>(size >> bucket_bits, 1, max_buckets);
+
+    // The input chunks are the same size as the buckets, on average. Each chunk
+    // and each bucket gets its own stream, in a fixed order, as in
+    // `pair_rounds::next_round`.
+    auto & streams = scratch.streams;
+    streams.clear();
+    for (size_t i = 0; i < 2 * num_buckets; i++)
+    {
+        streams.push_back(rng);
+        rng.jump();
+    }
+
+    auto const chunk_begin = [&](size_t chunk) { return size * chunk / num_buckets; };
+
+    // Count how many elements each chunk sends to each bucket...
+    auto & next = scratch.counts;
+    if (next.size() < num_buckets * num_buckets)
+        next.resize(num_buckets * num_buckets);
+    parallel_for(threads, num_buckets, [&](unsigned, size_t begin, size_t end) {
+        for (auto chunk = begin; chunk < end; chunk++)
+        {
+            auto stream = streams[chunk];
+            auto * const counts = &next[chunk * num_buckets];
+            std::fill_n(counts, num_buckets, 0);
+            for (auto i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++)
+                counts[draw_bucket(stream, num_buckets)]++;
+        }
+    });
+
+    // ...and so where each chunk's elements start in each bucket.
+    std::vector<size_t> bucket_begins(num_buckets + 1);
+    size_t position = 0;
+    for (size_t bucket = 0; bucket < num_buckets; bucket++)
+    {
+        bucket_begins[bucket] = position;
+        for (size_t chunk = 0; chunk < num_buckets; chunk++)
+            position += std::exchange(next[chunk * num_buckets + bucket], position);
+    }
+    bucket_begins[num_buckets] = position;
+
+    // Draw the same buckets again, and this time copy the elements there.
+    auto & shuffled = scratch.idxs;
+    shuffled.resize(size);
+    parallel_for(threads, num_buckets, [&](unsigned, size_t begin, size_t end) {
+        for (auto chunk = begin; chunk < end; chunk++)
+        {
+            auto stream = streams[chunk];
+            auto * const positions = &next[chunk * num_buckets];
+            for (auto i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++)
+                shuffled[positions[draw_bucket(stream, num_buckets)]++] = idxs[i];
+        }
+    });
+
+    parallel_for(threads, num_buckets, [&](unsigned, size_t begin, size_t end) {
+        for (auto bucket = begin; bucket < end; bucket++)
+        {
+            auto * const first = shuffled.data() + bucket_begins[bucket];
+            auto * const last = shuffled.data() + bucket_begins[bucket + 1];
+            std::shuffle(first, last, streams[num_buckets + bucket]);
+        }
+    });
+
+    std::swap(idxs, shuffled);
+}
+
+
+random_permutation::random_permutation(size_t size, rng_type & rng) : size {size}
+{
+    unsigned bits = 0;
+    while ((size_t {1} << bits) < size)
+        bits++;
+
+    half_bits = (bits + 1) / 2;
+
+    for (auto & key: keys)
+        key = rng();
+}
+
+
+size_t random_permutation::encrypt(size_t idx) const noexcept
+{
+    uint64_t const mask = (uint64_t {1} << half_bits) - 1;
+    uint64_t left = idx >> half_bits;
+    uint64_t right = idx & mask;
+
+    for (auto const key: keys)
+    {
+        auto const next = left ^ (mix(key ^ right) & mask);
+        left = right;
+        right = next;
+    }
+
+    return left << half_bits | right;
+}
+
+
+pair_rounds::pair_rounds(
+    pairing strategy, size_t rows, size_t cols, size_t block_size, size_t margin)
+    : strategy {strategy}
+    , rows {rows}
+    , cols {cols}
+    , block_size {block_size}
+    , margin {margin}
+{
+    check_pixel_index(rows * cols);
+}
+
+
+void pair_rounds::next_round(rng_type & rng, unsigned threads)
+{
+    switch (strategy)
+    {
+    case pairing::shuffled:
+        if (idxs.empty())
+        {
+            idxs.resize(rows * cols);
+            std::iota(idxs.begin(), idxs.end(), 0);
+        }
+        shuffle_indices(idxs, spare, rng, threads);
+        return;
+
+    case pairing::streamed:
+        permutation = random_permutation {rows * cols, rng};
+        return;
+
+    case pairing::blocked:
+        break;
+    }
+
+    auto const row_cuts = block_cuts(rng() % block_size, rows, block_size);
+    auto const col_cuts = block_cuts(rng() % block_size, cols, block_size);
+
+    // Leave out the pixels within `margin` of a cut, but not those along the
+    // edges of the image. Give each block its own stream, in a fixed order, so
+    // that the pairs don't depend on which thread processes which block.
+    auto const shrink = [&](size_t begin, size_t end, size_t length) {
+        begin += (begin > 0) ? margin : 0;
+        end -= (end < length) ? std::min(margin, end) : 0;
+        return std::make_pair(begin, std::max(begin, end));
+    };
+
+    blocks.clear();
+    for (size_t r = 0; r + 1 < row_cuts.size(); r++)
+    {
+        auto const [top, bottom] = shrink(row_cuts[r], row_cuts[r + 1], rows);
+        for (size_t c = 0; c + 1 < col_cuts.size(); c++)
+        {
+            auto const [left, right] = shrink(col_cuts[c], col_cuts[c + 1], cols);
+            blocks.push_back({top, bottom, left, right, rng});
+            rng.jump();
+        }
+    }
+}
+
+
+size_t pair_rounds::num_chunks() const noexcept
+{
+    if (strategy == pairing::blocked)
+        return blocks.size();
+
+    auto const num_pairs = rows * cols / 2;
+    return (num_pairs + chunk_pairs - 1) / chunk_pairs;
+}
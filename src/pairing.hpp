@@ -0,0 +1,195 @@
+// Choosing which pairs of pixels the swap engines compare.
+//
+// Each round pairs up the pixels of the image, with no pixel in two pairs, so
+// that the pairs can be compared and swapped in any order, or in parallel.
+// How the pairs are chosen trades off how fast colors mix against how much
+// memory traffic it costs:
+//
+// - `shuffled` shuffles an array of every pixel index, with
+//   `shuffle_indices`, and pairs neighboring entries. Pairs span the whole
+//   image, so colors move quickly, but nearly every access misses the cache.
+// - `blocked` cuts the image into square blocks, at a random offset each
+//   round, and pairs pixels within each block. Accesses stay local, and colors
+//   travel up to a block per round.
+// - `streamed` computes a random permutation on the fly, with a Feistel
+//   network keyed each round, instead of storing and shuffling an index
+//   array. Pairs still span the whole image.
+
+#ifndef PAIRING_HPP
+#define PAIRING_HPP
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "XoshiroCpp.hpp"
+#include "array2d.hpp"
+
+
+enum class pairing
+{
+    shuffled,
+    blocked,
+    streamed
+};
+
+// Parse the name of a pairing strategy. Return false if it isn't one.
+bool parse_pairing(std::string const & name, pairing & strategy);
+
+
+// Working space for `shuffle_indices`, kept between calls so that shuffling
+// again doesn't allocate it again: room for the shuffled indices, the table of
+// how many elements each chunk sends to each bucket, which takes up to 8 MiB,
+// and the streams of random numbers.
+struct shuffle_scratch
+{
+    std::vector<pixel_index> idxs;
+    std::vector<size_t> counts;
+    std::vector<XoshiroCpp::Xoshiro256StarStar> streams;
+};
+
+// Shuffle `idxs` uniformly at random, on up to `threads` threads, using
+// `scratch` for working space. Like `std::shuffle`, the order depends only on
+// the state of `rng`, and not on the number of threads.
+//
+// This is a bucketed shuffle. First, each element is sent to a random bucket:
+// each chunk of the input draws its elements' buckets from its own stream,
+// and then copies them to their buckets, in order. Then each bucket is
+// shuffled with its own stream. The buckets are small enough to shuffle in
+// cache, so on one thread this is about as fast as `std::shuffle` on large
+// images, where that misses the cache on nearly every swap.
+void shuffle_indices(
+    std::vector<pixel_index> & idxs,
+    shuffle_scratch & scratch,
+    XoshiroCpp::Xoshiro256StarStar & rng,
+    unsigned threads = 1);
+
+
+// A random permutation of [0, n), computed one element at a time.
+//
+// This is a four-round Feistel network over the smallest even number of bits
+// that covers `n`. It's a bijection over that range, and walking the cycle
+// past any results of `n` or more makes it a bijection over [0, n).
+class random_permutation
+{
+public:
+    using rng_type = XoshiroCpp::Xoshiro256StarStar;
+
+    random_permutation() noexcept = default;
+    random_permutation(size_t size, rng_type & rng);
+
+    size_t operator()(size_t idx) const noexcept
+    {
+        do
+            idx = encrypt(idx);
+        while (idx >= size);
+
+        return idx;
+    }
+
+private:
+    size_t encrypt(size_t idx) const noexcept;
+
+    size_t size = 0;
+    unsigned half_bits = 0;
+    std::array<uint64_t, 4> keys {};
+};
+
+
+// Rounds of disjoint pairs of pixels, chosen by a `pairing` strategy.
+class pair_rounds
+{
+public:
+    using rng_type = XoshiroCpp::Xoshiro256StarStar;
+
+    // Pair the pixels of a `rows` by `cols` image. For `pairing::blocked`,
+    // blocks are `block_size` on a side, and the `margin` pixels along each cut
+    // between blocks are left out of the round. A margin of one keeps the 3x3
+    // neighborhoods of different blocks apart.
+    pair_rounds(
+        pairing strategy,
+        size_t rows,
+        size_t cols,
+        size_t block_size = 0,
+        size_t margin = 0);
+
+    // Draw the pairs for the next round from `rng`, on up to `threads`
+    // threads. The pairs depend only on the state of `rng`.
+    void next_round(rng_type & rng, unsigned threads = 1);
+
+    // The pairs of a round are split into chunks, which may be processed in
+    // any order or at the same time.
+    size_t num_chunks() const noexcept;
+
+    // Call `fn(here, there)` for every pair in the given chunk. Each thread
+    // should bring its own `scratch`, which is reused between calls.
+    template <typename Fn>
+    void
+    for_each_pair(size_t chunk, std::vector<pixel_index> & scratch, Fn && fn) const;
+
+private:
+    // The number of pairs in each chunk of a `shuffled` or `streamed` round.
+    static constexpr size_t chunk_pairs = 1U << 14U;
+
+    // A rectangle of pixels, [row_begin, row_end) x [col_begin, col_end),
+    // along with the stream used to pair them up.
+    struct block
+    {
+        size_t row_begin, row_end;
+        size_t col_begin, col_end;
+        rng_type rng;
+    };
+
+    pairing const strategy;
+    size_t const rows;
+    size_t const cols;
+    size_t const block_size;
+    size_t const margin;
+
+    std::vector<pixel_index> idxs; // shuffled
+    shuffle_scratch spare; // shuffled
+    std::vector<block> blocks; // blocked
+    random_permutation permutation; // streamed
+};
+
+
+template <typename Fn>
+void pair_rounds::for_each_pair(
+    size_t chunk, std::vector<pixel_index> & scratch, Fn && fn) const
+{
+    auto const num_pairs = rows * cols / 2;
+    auto const begin = chunk * chunk_pairs;
+    auto const end = std::min(begin + chunk_pairs, num_pairs);
+
+    switch (strategy)
+    {
+    case pairing::shuffled:
+        for (auto i = begin; i < end; i++)
+            fn(idxs[2 * i], idxs[2 * i + 1]);
+        return;
+
+    case pairing::streamed:
+        for (auto i = begin; i < end; i++)
+            fn(permutation(2 * i), permutation(2 * i + 1));
+        return;
+
+    case pairing::blocked:
+    {
+        auto const & b = blocks[chunk];
+        auto rng = b.rng;
+
+        scratch.clear();
+        for (auto row = b.row_begin; row < b.row_end; row++)
+            for (auto col = b.col_begin; col < b.col_end; col++)
+                scratch.push_back(static_cast<pixel_index>(row * cols + col));
+
+        std::shuffle(scratch.begin(), scratch.end(), rng);
+        for (size_t i = 0; i + 1 < scratch.size(); i += 2)
+            fn(scratch[i], scratch[i + 1]);
+        return;
+    }
+    }
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include "palette_cache.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+#include "raw_image.hpp"
+
+
+namespace {
+
+// The version of `make_palette` that files on disk come from.
+constexpr int palette_version = 1;
+
+
+// Check that a saved palette has the right colors, at up to `samples` places
+// spread evenly along it, and at the end.
+bool looks_like_palette(rgb const * colors, size_t size, size_t samples = 4096)
+{
+    auto const step = std::max<size_t>(size / samples, 1);
+    for (size_t i = 0; i < size; i += step)
+    {
+        if (colors[i] != palette_color(size, i))
+            return false;
+    }
+    return size == 0 or colors[size - 1] == palette_color(size, size - 1);
+}
+
+} // anonymous namespace
+
+
+palette_cache::palette_cache(std::string directory)
+    : directory {std::move(directory)}
+{ }
+
+
+std::vector<rgb> const & palette_cache::get(size_t size)
+{
+    // Hold the lock while making a palette: another thread asking for the same
+    // size should wait for it rather than make it again.
+    std::lock_guard<std::mutex> const lock {mutex};
+    auto found = palettes.find(size);
+    if (found == palettes.end())
+        found = palettes.emplace(size, load_or_make(size)).first;
+
+    // Entries of a map don't move, so this stays valid without the lock.
+    return found->second;
+}
+
+
+std::string palette_cache::filename(size_t size) const
+{
+    return directory + "/palette-v" + std::to_string(palette_version) + "-" +
+        std::to_string(size) + ".raw";
+}
+
+
+std::vector<rgb> palette_cache::load_or_make(size_t size) const
+{
+    if (directory.empty())
+        return make_palette(size);
+
+    auto const name = filename(size);
+    try
+    {
+        if (is_raw_image(name.c_str()))
+        {
+            mapped_image const saved {name.c_str()};
+            if (saved.rows() == 1 and saved.cols() == size and
+                looks_like_palette(saved.data(), size))
+                return {saved.data(), saved.data() + size};
+        }
+    }
+    catch (std::runtime_error const &)
+    {
+        // A truncated or broken file is no use; make the palette instead.
+    }
+
+    auto palette = make_palette(size);
+
+    // Write under a name of our own and rename it, so that other processes
+    // only ever see whole palettes. The cache is only an optimization, so if
+    // the directory can't be written, carry on without it.
+    auto const unique = std::to_string(std::random_device {}());
+    auto const temporary = name + "." + unique + ".tmp";
+    try
+    {
+        write_raw_image(1, size, temporary.c_str(), [&](size_t) {
+            return palette.data();
+        });
+        if (std::rename(temporary.c_str(), name.c_str()) != 0)
+            std::remove(temporary.c_str());
+    }
+    catch (std::runtime_error const &)
+    {
+        std::remove(temporary.c_str());
+    }
+
+    return palette;
+}
@@ -0,0 +1,48 @@
+// Keeping palettes from `make_palette`, so that each size is only made once.
+//
+// Runs over many images, or many runs over the same image, keep asking for the
+// same few palette sizes. Making one that isn't 2^24 colors means decoding a
+// Hilbert curve sample for every color, which takes about half a second for
+// 4000x4000. A cache keeps each palette in memory once it's made, and can also
+// keep it on disk, as a one-row raw image, to be mapped back in by later runs.
+//
+// A file on disk is only used if it looks like the palette it's named for: the
+// right size, and with the right colors at a few thousand places spread along
+// it, which takes far less time than making the palette. Anything else, from a
+// truncated file to one left by another version, is made again and replaced.
+
+#ifndef PALETTE_CACHE_HPP
+#define PALETTE_CACHE_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "colors.hpp"
+
+
+class palette_cache
+{
+public:
+    // Keep palettes in memory, and also in `directory` if it isn't empty.
+    explicit palette_cache(std::string directory = {});
+
+    // Return `make_palette(size)`, from the cache if it's there. This is safe
+    // to call from several threads, and the palette stays valid for as long as
+    // the cache does.
+    std::vector<rgb> const & get(size_t size);
+
+    // Where a palette of this size is kept on disk. The name has a version in
+    // it, which goes up whenever `make_palette` changes its colors.
+    std::string filename(size_t size) const;
+
+private:
+    std::vector<rgb> load_or_make(size_t size) const;
+
+    std::string const directory;
+    std::mutex mutex;
+    std::map<size_t, std::vector<rgb>> palettes;
+};
+
+#endif
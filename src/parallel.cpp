@@ -0,0 +1,132 @@
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+
+namespace {
+
+std::atomic<bool> pinning {false};
+
+// The CPUs to pin threads to, in order, set before pinning is turned on.
+std::vector<size_t> pinned_cpus;
+
+#ifdef __linux__
+
+// Return the NUMA node of a CPU, from sysfs, or zero if it doesn't say.
+int numa_node(size_t cpu)
+{
+    std::filesystem::path const directory {
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu)};
+    std::string const prefix {"node"};
+
+    std::error_code error;
+    for (auto const & entry: std::filesystem::directory_iterator {directory, error})
+    {
+        auto const name = entry.path().filename().string();
+        auto const digit = (name.size() > prefix.size()) ? name[prefix.size()] : ' ';
+        if (name.compare(0, prefix.size(), prefix) == 0 and
+            std::isdigit(static_cast<unsigned char>(digit)))
+            return std::stoi(name.substr(prefix.size()));
+    }
+
+    return 0;
+}
+
+
+// The CPUs this process may run on, in order of NUMA node, and then number,
+// so that consecutive threads fill one node before the next. CPUs are often
+// numbered alternately between sockets, which this undoes.
+std::vector<size_t> numa_ordered_cpus()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+        return {};
+
+    std::vector<std::pair<int, size_t>> cpus;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.emplace_back(numa_node(cpu), cpu);
+    }
+    std::sort(cpus.begin(), cpus.end());
+
+    std::vector<size_t> ordered;
+    for (auto const & [node, cpu]: cpus)
+        ordered.push_back(cpu);
+    return ordered;
+}
+
+#endif
+
+} // anonymous namespace
+
+
+void set_thread_pinning(bool pin)
+{
+#ifdef __linux__
+    // Read the CPUs before pinning any thread, which narrows them down.
+    if (pin and pinned_cpus.empty())
+        pinned_cpus = numa_ordered_cpus();
+
+    pinning = pin and not pinned_cpus.empty();
+#else
+    static_cast<void>(pin);
+#endif
+}
+
+
+thread_pin::thread_pin(unsigned t)
+{
+#ifdef __linux__
+    if (not pinning)
+        return;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+        return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(pinned_cpus[t % pinned_cpus.size()], &cpus);
+    if (sched_setaffinity(0, sizeof cpus, &cpus) != 0)
+    {
+        pinning = false;
+        return;
+    }
+
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+            previous.push_back(cpu);
+    }
+#else
+    static_cast<void>(t);
+#endif
+}
+
+
+thread_pin::~thread_pin()
+{
+#ifdef __linux__
+    if (previous.empty())
+        return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto const cpu: previous)
+        CPU_SET(cpu, &cpus);
+    sched_setaffinity(0, sizeof cpus, &cpus);
+#endif
+}
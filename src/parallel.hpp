@@ -0,0 +1,75 @@
+// Running loops across several threads.
+//
+// Nothing fancy: the parallel loops in this project are long, uniform, and
+// few, so spawning threads per loop costs nothing worth pooling.
+//
+// Every loop splits its range the same way for the same number of threads, so
+// with pinning on, thread t of one loop runs where thread t of the last one
+// did. An array that one loop fills in and the next works on then stays in
+// the memory of the NUMA node that uses it.
+
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+
+// Pin thread t of every parallel loop, the calling thread being thread zero
+// for as long as the loop runs, to the t-th CPU this process may run on, in
+// order of NUMA node, wrapping around if there are more threads than CPUs. Off
+// by default, which leaves threads to the OS. Only Linux supports pinning;
+// elsewhere, this does nothing.
+void set_thread_pinning(bool pin);
+
+// Pin the calling thread as thread `t` of a parallel loop, if pinning is on,
+// and put it back on the CPUs it could run on before when this goes out of
+// scope. If the OS refuses to pin a thread, pinning turns off.
+class thread_pin
+{
+public:
+    explicit thread_pin(unsigned t);
+    ~thread_pin();
+
+    thread_pin(thread_pin const &) = delete;
+    thread_pin & operator=(thread_pin const &) = delete;
+
+private:
+    // The CPUs the thread could run on before, or none if it wasn't pinned.
+    std::vector<size_t> previous;
+};
+
+
+// Split `[0, size)` into `threads` contiguous chunks of nearly equal size, and
+// call `fn(thread, begin, end)` for each chunk on its own thread. The calling
+// thread runs chunk zero, and all chunks are finished when this returns.
+template <typename Fn>
+void parallel_for(unsigned threads, size_t size, Fn const & fn)
+{
+    // A loop on one thread runs wherever it's called from, like on a thread
+    // of another loop.
+    if (threads <= 1)
+    {
+        fn(0U, size_t {0}, size);
+        return;
+    }
+
+    auto const chunk_begin = [=](unsigned t) { return size * t / threads; };
+    auto const run = [&fn](unsigned t, size_t begin, size_t end) {
+        thread_pin const pin {t};
+        fn(t, begin, end);
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; t++)
+        workers.emplace_back(run, t, chunk_begin(t), chunk_begin(t + 1));
+
+    run(0U, size_t {0}, chunk_begin(1));
+
+    for (auto & worker: workers)
+        worker.join();
+}
+
+#endif
@@ -1,83 +1,672 @@
 #include "permutations.hpp"
 
 #include <algorithm>
-#include <iostream>
+#include <array>
+#include <cmath>
+#include <limits>
 #include <numeric>
 #include <random>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
 
+#include "hilbert.hpp"
+#include "parallel.hpp"
+#include "pixel_layout.hpp"
+#include "snapshot.hpp"
+#include "tent_blur.hpp"
 
-void match_ascending(array2d<rgb> const & input, array2d<rgb> & output)
+
+array2d<lab> to_lab(array2d<rgb> const & image)
+{
+    // Building the table costs about as much as converting 2^23 pixels
+    // directly, but a run usually converts the same size image several times.
+    constexpr size_t table_threshold = rgb::num_colors / 4;
+    if (image.size() < table_threshold and not lab_table::is_built())
+        return array2d<lab> {image};
+
+    auto const & table = lab_table::instance();
+    array2d<lab> converted(image.rows, image.cols);
+    for (size_t i = 0; i < image.size(); i++)
+        converted[i] = table[image[i]];
+
+    return converted;
+}
+
+
+lab_images::lab_images(array2d<rgb> const & input, array2d<rgb> const & output)
+    : input {to_lab(input)}, output {to_lab(output)}
+{ }
+
+
+namespace {
+
+// Report on a finished pass, and return true if the engine should stop, based
+// on the `report` of this pass and the `previous` one.
+bool finish_pass(
+    swap_options const & options,
+    pass_report const & previous,
+    pass_report const & report)
+{
+    if (options.progress)
+        options.progress(report);
+
+    auto const timed_out =
+        options.deadline and std::chrono::steady_clock::now() >= *options.deadline;
+
+    auto const stalled = options.min_rms_gain > 0 and
+        previous.rms() - report.rms() < options.min_rms_gain;
+
+    return report.swap_rate() < options.min_swap_rate or stalled or timed_out;
+}
+
+
+// Time a pass of an engine from its start, and the part of it spent choosing
+// pairs, for its report.
+class pass_timer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Run `choose`, and count its time as choosing pairs.
+    template <typename Choose>
+    void choose_pairs(Choose && choose)
+    {
+        auto const begin = clock::now();
+        choose();
+        shuffling += clock::now() - begin;
+    }
+
+    // Fill in the times of a finished pass.
+    pass_report timed(pass_report report) const
+    {
+        report.seconds = std::chrono::duration<double> {clock::now() - start}.count();
+        report.shuffle_seconds = shuffling.count();
+        return report;
+    }
+
+private:
+    clock::time_point const start = clock::now();
+    std::chrono::duration<double> shuffling {0};
+};
+
+} // anonymous namespace
+
+
+namespace {
+
+// `match_ascending` sorts pixels by CIELAB lightness, quantized to 16 bits.
+// That's a resolution of about 0.0015, far below a perceptible difference,
+// and few enough keys to sort by counting them.
+using lightness_key = uint16_t;
+constexpr size_t num_lightness_keys = size_t {1} << 16U;
+
+// The top bit of a sorted pixel index marks a finished cycle when permuting.
+constexpr pixel_index done_bit = pixel_index {1}
+    << (std::numeric_limits<pixel_index>::digits - 1);
+
+
+// The lightness of colors, without the rest of their CIELAB values.
+class lightness
 {
-    // Convert to CIELAB for luminance.
-    auto const input_lab = array2d<lab> {input};
-    auto const output_lab = array2d<lab> {output};
-
-    // Sort the indices of input picture based on the luminance of the pixel
-    // to which they refer.
-    std::vector<size_t> input_indices(input.size());
-    std::iota(input_indices.begin(), input_indices.end(), 0);
-    std::sort(input_indices.begin(), input_indices.end(), [&](auto lhs, auto rhs) {
-        return input_lab[lhs].L < input_lab[rhs].L;
+public:
+    lightness()
+    {
+        // Follow the arithmetic of `xyz {rgb_float}`, but only for Y.
+        for (size_t i = 0; i < 256; i++)
+        {
+            auto c = static_cast<double>(i) / 255.0;
+            c = (c > 0.04045) ? std::pow((c + 0.055) / 1.055, 2.4) : (c / 12.92);
+            red[i] = c * 100 * 0.2126;
+            green[i] = c * 100 * 0.7152;
+            blue[i] = c * 100 * 0.0722;
+        }
+    }
+
+    lightness_key operator()(rgb color) const noexcept
+    {
+        constexpr double key_scale = (num_lightness_keys - 1) / 100.0;
+
+        // Follow the arithmetic of `lab {xyz}`, but only for L.
+        auto const y = (red[color.r] + green[color.g] + blue[color.b]) / 100.0;
+        auto const f = (y > 0.008856) ? std::cbrt(y) : (7.787 * y) + 16.0 / 116.0;
+        auto const L = std::clamp((116.0 * f) - 16.0, 0.0, 100.0);
+        return static_cast<lightness_key>(std::lround(L * key_scale));
+    }
+
+private:
+    std::array<double, 256> red {};
+    std::array<double, 256> green {};
+    std::array<double, 256> blue {};
+};
+
+
+// Fill `keys` with the lightness of each pixel of `image`.
+void lightness_keys(
+    array2d<rgb> const & image, std::vector<lightness_key> & keys, unsigned threads)
+{
+    lightness const key;
+    keys.resize(image.size());
+    parallel_for(threads, image.size(), [&](unsigned, size_t begin, size_t end) {
+        for (auto i = begin; i < end; i++)
+            keys[i] = key(image[i]);
     });
+}
+
 
-    // Sort the indices of the output based on the luminance of the pixel
-    // to which they refer.
-    std::vector<size_t> output_indices(output.size());
-    std::iota(output_indices.begin(), output_indices.end(), 0);
-    std::sort(output_indices.begin(), output_indices.end(), [&](auto lhs, auto rhs) {
-        return output_lab[lhs].L < output_lab[rhs].L;
+// Return the indices of `keys` in ascending order of key, and in ascending
+// order of index among equal keys.
+//
+// This is a parallel counting sort: each thread counts the keys of its own
+// contiguous chunk, and then places its indices after those of the same key
+// from earlier chunks.
+std::vector<pixel_index>
+sort_by_key(std::vector<lightness_key> const & keys, unsigned threads)
+{
+    std::vector<std::vector<pixel_index>> next(
+        threads, std::vector<pixel_index>(num_lightness_keys));
+    parallel_for(threads, keys.size(), [&](unsigned t, size_t begin, size_t end) {
+        auto & counts = next[t];
+        for (auto i = begin; i < end; i++)
+            counts[keys[i]]++;
     });
 
-    // The darkest pixel in the original `output` is copied to the position of
-    // the darkest pixel in the `input` image, and so on.
-    auto const original_output = output;
-    for (size_t i = 0; i < output.size(); i++)
-        output[input_indices[i]] = original_output[output_indices[i]];
-};
+    pixel_index position = 0;
+    for (size_t key = 0; key < num_lightness_keys; key++)
+        for (auto & thread_next: next)
+            position += std::exchange(thread_next[key], position);
+
+    std::vector<pixel_index> sorted(keys.size());
+    parallel_for(threads, keys.size(), [&](unsigned t, size_t begin, size_t end) {
+        auto & thread_next = next[t];
+        for (auto i = begin; i < end; i++)
+            sorted[thread_next[keys[i]]++] = static_cast<pixel_index>(i);
+    });
+
+    return sorted;
+}
+
+
+// Sort `images` in place by `keys`, permuting the keys along with them.
+//
+// This is an American flag sort: count the keys, then swap each pixel
+// straight into the next free slot of its key's range.
+template <typename... Images>
+void sort_in_place(std::vector<lightness_key> & keys, Images &... images)
+{
+    std::vector<size_t> begins(num_lightness_keys + 1);
+    for (auto const key: keys)
+        begins[key + 1U]++;
+    std::partial_sum(begins.begin(), begins.end(), begins.begin());
+
+    auto next = begins;
+    for (size_t key = 0; key < num_lightness_keys; key++)
+    {
+        while (next[key] < begins[key + 1])
+        {
+            auto const i = next[key];
+            if (keys[i] == key)
+            {
+                next[key]++;
+                continue;
+            }
+
+            auto const j = next[keys[i]]++;
+            std::swap(keys[i], keys[j]);
+            (std::swap(images[i], images[j]), ...);
+        }
+    }
+}
+
+
+// Move each `image[i]` to `image[destinations[i]]`, for each of `images`, in
+// place, by following the cycles of the permutation. This marks off the
+// destinations as it goes.
+template <typename... Images>
+void permute_in_place(std::vector<pixel_index> & destinations, Images &... images)
+{
+    for (size_t start = 0; start < destinations.size(); start++)
+    {
+        if ((destinations[start] & done_bit) != 0)
+            continue;
+
+        auto carried = std::make_tuple(images[start]...);
+        auto i = start;
+        do
+        {
+            auto const destination = destinations[i];
+            destinations[i] |= done_bit;
+            std::apply(
+                [&](auto &... values) {
+                    (std::swap(values, images[destination]), ...);
+                },
+                carried);
+            i = destination;
+        } while (i != start);
+    }
+}
+
+
+// Sort `output` to match the lightness of `input`, as `match_ascending`, and
+// move the `carried` images along with it.
+template <typename... Carried>
+void match_lightness(
+    array2d<rgb> const & input,
+    array2d<rgb> & output,
+    unsigned threads,
+    Carried &... carried)
+{
+    if (output.size() >= done_bit)
+        throw std::length_error("image too large to match in ascending order");
+
+    // Find where the darkest input pixel is, and the next darkest, and so on.
+    std::vector<lightness_key> keys;
+    lightness_keys(input, keys, threads);
+    auto input_order = sort_by_key(keys, threads);
+
+    // Sort the output from darkest to lightest. Then the darkest output pixel
+    // belongs in the position of the darkest input pixel, and so on.
+    lightness_keys(output, keys, threads);
+    sort_in_place(keys, output, carried...);
+    permute_in_place(input_order, output, carried...);
+}
+
+} // anonymous namespace
+
+
+void match_ascending(
+    array2d<rgb> const & input, array2d<rgb> & output, unsigned threads)
+{
+    match_lightness(input, output, threads);
+}
+
+
+void match_ascending(
+    array2d<rgb> const & input,
+    array2d<rgb> & output,
+    lab_images & labs,
+    unsigned threads)
+{
+    match_lightness(input, output, threads, labs.output);
+}
 
 
 void compare_and_swap(
     array2d<rgb> const & input,
     array2d<rgb> & output,
     int passes,
-    permute_rng_type & rng)
+    permute_rng_type & rng,
+    swap_options const & options)
 {
     // Convert the images into CIELAB color space to measure perceived
     // differences.
-    auto const input_lab = array2d<lab> {input};
-    auto output_lab = array2d<lab> {output};
+    lab_images labs {input, output};
+    compare_and_swap(output, labs, passes, rng, options);
+}
+
+
+void compare_and_swap(
+    array2d<rgb> & output,
+    lab_images & labs,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options)
+{
+    swap_pixels<default_pixel_layout> pixels {
+        output, labs.input, labs.output, options.threads};
+
+    error_tracker errors {output.size()};
+    for (size_t i = 0; i < output.size(); i++)
+        errors.add_pixel(diff2(pixels.output_lab(i), pixels.input_lab(i)));
+
+    // No pixel is in two pairs, so the pairs can be compared and swapped in
+    // any order, on any number of threads, with the same result.
+    pair_rounds rounds {options.pairs, output.rows, output.cols, options.block_size};
 
-    // Each pixel will be `here` once per pass, and `there` once per pass.
-    std::vector<size_t> here_idxs(input.size());
-    std::iota(here_idxs.begin(), here_idxs.end(), 0);
-    std::vector<size_t> there_idxs(input.size());
-    std::iota(there_idxs.begin(), there_idxs.end(), 0);
+    // Count the swaps and changes in error on each thread.
+    std::vector<swap_tally> tallies(options.threads);
+
+    auto const work = [&](unsigned thread, size_t begin, size_t end) {
+        std::vector<pixel_index> scratch;
+        swap_tally tally;
+
+        for (auto chunk = begin; chunk < end; chunk++)
+        {
+            rounds.for_each_pair(chunk, scratch, [&](size_t here, size_t there) {
+                // What are the squared differences between these output
+                // pixels and the corresponding input pixels?
+                auto const here_now =
+                    diff2(pixels.output_lab(here), pixels.input_lab(here));
+                auto const there_now =
+                    diff2(pixels.output_lab(there), pixels.input_lab(there));
+
+                // If the pixels were swapped, what would they be?
+                auto const here_swapped =
+                    diff2(pixels.output_lab(there), pixels.input_lab(here));
+                auto const there_swapped =
+                    diff2(pixels.output_lab(here), pixels.input_lab(there));
+
+                if (here_swapped + there_swapped < here_now + there_now)
+                {
+                    pixels.swap(here, there);
+                    tally.record(here_now, there_now, here_swapped, there_swapped);
+                }
+            });
+        }
 
+        tallies[thread] = tally;
+    };
+
+    // Each pass is two rounds of pairings, so that each pixel is `here` about
+    // once per pass, and `there` about once per pass.
     for (int pass = 0; pass < passes; pass++)
     {
-        std::shuffle(here_idxs.begin(), here_idxs.end(), rng);
-        std::shuffle(there_idxs.begin(), there_idxs.end(), rng);
+        pass_timer timer;
+        swap_tally pass_tally;
+        for (int round = 0; round < 2; round++)
+        {
+            timer.choose_pairs([&] { rounds.next_round(rng, options.threads); });
+            parallel_for(options.threads, rounds.num_chunks(), work);
+            for (auto const & tally: tallies)
+                pass_tally += tally;
+        }
+
+        auto const previous = errors.report();
+        if (finish_pass(options, previous, timer.timed(errors.finish_pass(pass_tally))))
+            break;
+    }
+
+    pixels.write_output(output, labs.output);
+}
+
 
-        for (size_t i = 0; i < input.size(); i++)
+namespace {
+
+//////////////////////////////////////////////////////////////////////////////
+// Coarse to fine
+//
+// `compare_and_swap_coarse` solves a much smaller problem than the full one:
+// it cuts the image into blocks, and the output's colors into groups of
+// similar colors, one the size of each block. Then it swaps whole groups
+// between blocks, to match each block's average input color. Against the mean
+// input color t of a block, the squared error of a group of colors c is
+//
+//     sum |c - t|^2 = n |mean(c) - t|^2 + sum |c - mean(c)|^2
+//
+// and the last term goes wherever the group goes. So comparing the means of
+// the groups with the means of the blocks is exact. There's one comparison
+// per block instead of per pixel, so a pass over 4x4 blocks makes a sixteenth
+// of the comparisons of a pass over the pixels.
+
+// The mean CIELAB value and the size of each block of `image`, in row-major
+// order of blocks. Blocks on the bottom and right edges may be partial.
+void block_means(
+    array2d<lab> const & image,
+    size_t block,
+    std::vector<lab> & means,
+    std::vector<pixel_index> & sizes)
+{
+    auto const block_cols = (image.cols + block - 1) / block;
+    auto const block_rows = (image.rows + block - 1) / block;
+    means.assign(block_rows * block_cols, lab {});
+    sizes.assign(means.size(), 0);
+
+    std::vector<std::array<double, 3>> sums(block_cols);
+    for (size_t block_row = 0; block_row < block_rows; block_row++)
+    {
+        std::fill(sums.begin(), sums.end(), std::array<double, 3> {});
+        auto const end_row = std::min(image.rows, (block_row + 1) * block);
+        for (auto row = block_row * block; row < end_row; row++)
         {
-            auto here = here_idxs[i];
-            auto there = there_idxs[i];
+            for (size_t col = 0; col < image.cols; col++)
+            {
+                auto const & color = image(row, col);
+                auto & sum = sums[col / block];
+                sum[0] += static_cast<double>(color.L);
+                sum[1] += static_cast<double>(color.a);
+                sum[2] += static_cast<double>(color.b);
+            }
+        }
 
-            // What is the sum of the squared differences between these output
-            // pixels and the corresponding input pixels?
-            auto current = diff2(output_lab[here], input_lab[here]) +
-                diff2(output_lab[there], input_lab[there]);
+        auto const rows = end_row - block_row * block;
+        for (size_t block_col = 0; block_col < block_cols; block_col++)
+        {
+            auto const cols = std::min(image.cols, (block_col + 1) * block) -
+                block_col * block;
+            auto const i = block_row * block_cols + block_col;
+            auto const count = static_cast<double>(rows * cols);
+            auto const & sum = sums[block_col];
+            means[i].L = static_cast<float>(sum[0] / count);
+            means[i].a = static_cast<float>(sum[1] / count);
+            means[i].b = static_cast<float>(sum[2] / count);
+            sizes[i] = static_cast<pixel_index>(rows * cols);
+        }
+    }
+}
 
-            // If the pixels were swapped, what's the sum of differences?
-            auto swapped = diff2(output_lab[here], input_lab[there]) +
-                diff2(output_lab[there], input_lab[here]);
 
-            if (swapped < current)
+// The pixels of an image of `rows` by `cols`, block by block, in row-major
+// order of blocks and of pixels within each.
+std::vector<pixel_index> block_order(size_t rows, size_t cols, size_t block)
+{
+    std::vector<pixel_index> order;
+    order.reserve(rows * cols);
+    for (size_t top = 0; top < rows; top += block)
+        for (size_t left = 0; left < cols; left += block)
+            for (auto row = top; row < std::min(rows, top + block); row++)
+                for (auto col = left; col < std::min(cols, left + block); col++)
+                    order.push_back(static_cast<pixel_index>(row * cols + col));
+
+    return order;
+}
+
+
+// The pixels of `output` in order along the Hilbert curve, so that runs of
+// them are groups of similar colors.
+//
+// This sorts by the 24-bit Hilbert index in two stable counting passes, by
+// its low half and then by its high half.
+std::vector<pixel_index> hilbert_order(array2d<rgb> const & output)
+{
+    constexpr unsigned half_bits = 12;
+    constexpr unsigned half_mask = (1U << half_bits) - 1;
+
+    std::vector<unsigned> indices(output.size());
+    hilbert_encode(output.data.data(), output.size(), indices.data());
+
+    std::vector<pixel_index> order(output.size());
+    std::iota(order.begin(), order.end(), pixel_index {0});
+    std::vector<pixel_index> sorted(output.size());
+    for (auto const shift: {0U, half_bits})
+    {
+        std::vector<size_t> next(size_t {1} << half_bits);
+        for (auto const index: indices)
+            next[(index >> shift) & half_mask]++;
+        size_t position = 0;
+        for (auto & count: next)
+            position += std::exchange(count, position);
+
+        for (auto const i: order)
+            sorted[next[(indices[i] >> shift) & half_mask]++] = i;
+        std::swap(order, sorted);
+    }
+
+    return order;
+}
+
+
+// A pixel's lightness, and its index.
+using lit_pixel = std::pair<float, pixel_index>;
+
+// Fill `sorted` with the pixels [first, last) of `image`, in ascending order
+// of lightness, and then of index, so that ties are reproducible.
+void sort_by_lightness(
+    array2d<lab> const & image,
+    pixel_index const * first,
+    pixel_index const * last,
+    std::vector<lit_pixel> & sorted)
+{
+    sorted.clear();
+    for (auto const * i = first; i < last; i++)
+        sorted.emplace_back(image[*i].L, *i);
+    std::sort(sorted.begin(), sorted.end());
+}
+
+
+// Run one level of `compare_and_swap_coarse`, on blocks of side `block`, with
+// the groups of colors cut from `colors` in order, one the size of each block.
+void swap_groups(
+    array2d<rgb> & output,
+    lab_images & labs,
+    size_t block,
+    std::vector<pixel_index> const & colors,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options)
+{
+    std::vector<lab> targets;
+    std::vector<pixel_index> sizes;
+    block_means(labs.input, block, targets, sizes);
+    auto const num_blocks = targets.size();
+
+    std::vector<pixel_index> group_begins(num_blocks + 1);
+    std::partial_sum(sizes.begin(), sizes.end(), group_begins.begin() + 1);
+
+    std::vector<lab> means(num_blocks);
+    for (size_t group = 0; group < num_blocks; group++)
+    {
+        std::array<double, 3> sum {};
+        for (auto i = group_begins[group]; i < group_begins[group + 1]; i++)
+        {
+            auto const & color = labs.output[colors[i]];
+            sum[0] += static_cast<double>(color.L);
+            sum[1] += static_cast<double>(color.a);
+            sum[2] += static_cast<double>(color.b);
+        }
+
+        auto const count = static_cast<double>(sizes[group]);
+        means[group].L = static_cast<float>(sum[0] / count);
+        means[group].a = static_cast<float>(sum[1] / count);
+        means[group].b = static_cast<float>(sum[2] / count);
+    }
+
+    // The group in each block, and its mean, kept in step as groups swap.
+    std::vector<pixel_index> groups(num_blocks);
+    std::iota(groups.begin(), groups.end(), pixel_index {0});
+
+    // Groups only swap between blocks of the same size, so every block's
+    // error counts the same, and the mean error of blocks is reported.
+    error_tracker errors {num_blocks};
+    for (size_t i = 0; i < num_blocks; i++)
+        errors.add_pixel(diff2(means[i], targets[i]));
+
+    // There are few enough blocks to compare and swap on one thread. Pair
+    // neighbors in a shuffled order of blocks, like `pairing::shuffled`.
+    std::vector<pixel_index> order(num_blocks);
+    std::iota(order.begin(), order.end(), pixel_index {0});
+    shuffle_scratch scratch;
+    for (int pass = 0; pass < passes; pass++)
+    {
+        pass_timer timer;
+        swap_tally tally;
+        for (int round = 0; round < 2; round++)
+        {
+            timer.choose_pairs([&] { shuffle_indices(order, scratch, rng); });
+            for (size_t i = 0; i + 1 < num_blocks; i += 2)
             {
-                std::swap(output[here], output[there]);
-                std::swap(output_lab[here], output_lab[there]);
+                auto const here = order[i];
+                auto const there = order[i + 1];
+                if (sizes[here] != sizes[there])
+                    continue;
+
+                auto const here_now = diff2(means[here], targets[here]);
+                auto const there_now = diff2(means[there], targets[there]);
+                auto const here_swapped = diff2(means[there], targets[here]);
+                auto const there_swapped = diff2(means[here], targets[there]);
+                if (here_swapped + there_swapped < here_now + there_now)
+                {
+                    std::swap(groups[here], groups[there]);
+                    std::swap(means[here], means[there]);
+                    tally.record(here_now, there_now, here_swapped, there_swapped);
+                }
             }
         }
+
+        auto const previous = errors.report();
+        if (finish_pass(options, previous, timer.timed(errors.finish_pass(tally))))
+            break;
+    }
+
+    // Lay out each block's group, matching its lightest color to the block's
+    // lightest input pixel, and so on, so the finer passes after this one start
+    // from the block's shading.
+    auto const blocks = block_order(output.rows, output.cols, block);
+    array2d<rgb> laid_out(output.rows, output.cols);
+    array2d<lab> laid_out_labs(output.rows, output.cols);
+    parallel_for(options.threads, num_blocks, [&](unsigned, size_t begin, size_t end) {
+        std::vector<lit_pixel> pixels;
+        std::vector<lit_pixel> group_colors;
+        for (auto i = begin; i < end; i++)
+        {
+            sort_by_lightness(
+                labs.input,
+                blocks.data() + group_begins[i],
+                blocks.data() + group_begins[i + 1],
+                pixels);
+            sort_by_lightness(
+                labs.output,
+                colors.data() + group_begins[groups[i]],
+                colors.data() + group_begins[groups[i] + 1],
+                group_colors);
+
+            for (size_t j = 0; j < pixels.size(); j++)
+            {
+                auto const to = pixels[j].second;
+                auto const from = group_colors[j].second;
+                laid_out[to] = output[from];
+                laid_out_labs[to] = labs.output[from];
+            }
+        }
+    });
+
+    output.data = std::move(laid_out.data);
+    labs.output.data = std::move(laid_out_labs.data);
+}
+
+} // anonymous namespace
+
+
+void compare_and_swap_coarse(
+    array2d<rgb> const & input,
+    array2d<rgb> & output,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options)
+{
+    lab_images labs {input, output};
+    compare_and_swap_coarse(output, labs, passes, rng, options);
+}
+
+
+void compare_and_swap_coarse(
+    array2d<rgb> & output,
+    lab_images & labs,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options)
+{
+    check_pixel_index(output.size());
+
+    // The first level cuts the colors into groups along the Hilbert curve.
+    // Each level after it halves the blocks, and starts from the colors the
+    // last level left in each.
+    auto block = std::max<size_t>(options.coarse_block_size, 2);
+    swap_groups(output, labs, block, hilbert_order(output), passes, rng, options);
+    while (block > 2)
+    {
+        block /= 2;
+        auto const colors = block_order(output.rows, output.cols, block);
+        swap_groups(output, labs, block, colors, passes, rng, options);
     }
 }
 
@@ -104,289 +693,285 @@ namespace {
 // performance increase: the random memory access pattern means that FP
 // computation is not the execution bottleneck.
 //
-// For handling the edges, neither reflecting or extending seem right to
-// me, so instead, truncate the kernel at the edges. This means there are
-// nine kernels to select from based on the location of the pixel.
-
-constexpr uint8_t TOP = 1;
-constexpr uint8_t BOTTOM = 2;
-constexpr uint8_t LEFT = 4;
-constexpr uint8_t RIGHT = 8;
-constexpr uint8_t edges(size_t row, size_t col, size_t rows, size_t cols)
-{
-    // clang-format off
-    return (row == 0        ? TOP    : 0U) |
-           (row == rows - 1 ? BOTTOM : 0U) |
-           (col == 0        ? LEFT   : 0U) |
-           (col == cols - 1 ? RIGHT  : 0U);
-    // clang-format on
-}
-
-// Convolve the given pixel with a Gaussian with a hole in the middle, i.e.:
-//
-//     1  2  1
-//     2  0  2
-//     1  2  1
-//
-// This result can be added to a central pixel to get the complete convolution.
-rgb_float blur_around(array2d<rgb> const & array, size_t neighborhood)
-{
-    size_t col = neighborhood % array.cols;
-    size_t row = neighborhood / array.cols;
+// The blur itself, and how it handles the edges, is `tent_blur`, in
+// tent_blur.hpp.
 
-    // Determine which of nine kernels to use, based on edge adjacency.
-    uint8_t const region = edges(row, col, array.rows, array.cols);
 
-    // Ignore the degenerate cases where a pixel is adjacent to more than two
-    // edges, which only occur in images with a single row or column.
-    switch (region)
-    {
-    case TOP: // clang-format off
-        return rgb_float{array(row    , col - 1)} * 2.0 +
-               rgb_float{array(row    , col + 1)} * 2.0 +
-               rgb_float{array(row + 1, col - 1)} * 1.0 +
-               rgb_float{array(row + 1, col    )} * 2.0 +
-               rgb_float{array(row + 1, col + 1)} * 1.0;
-    case BOTTOM:
-        return rgb_float{array(row - 1, col - 1)} * 1.0 +
-               rgb_float{array(row - 1, col    )} * 2.0 +
-               rgb_float{array(row - 1, col + 1)} * 1.0 +
-               rgb_float{array(row    , col - 1)} * 2.0 +
-               rgb_float{array(row    , col + 1)} * 2.0;
-    case LEFT:
-        return rgb_float{array(row - 1, col    )} * 2.0 +
-               rgb_float{array(row - 1, col + 1)} * 1.0 +
-               rgb_float{array(row    , col + 1)} * 2.0 +
-               rgb_float{array(row + 1, col    )} * 2.0 +
-               rgb_float{array(row + 1, col + 1)} * 1.0;
-    case RIGHT:
-        return rgb_float{array(row - 1, col - 1)} * 1.0 +
-               rgb_float{array(row - 1, col    )} * 2.0 +
-               rgb_float{array(row    , col - 1)} * 2.0 +
-               rgb_float{array(row + 1, col - 1)} * 1.0 +
-               rgb_float{array(row + 1, col    )} * 2.0;
-    case TOP | LEFT:
-        return rgb_float{array(row    , col + 1)} * 2.0 +
-               rgb_float{array(row + 1, col    )} * 2.0 +
-               rgb_float{array(row + 1, col + 1)} * 1.0;
-    case TOP | RIGHT:
-        return rgb_float{array(row    , col - 1)} * 2.0 +
-               rgb_float{array(row + 1, col - 1)} * 1.0 +
-               rgb_float{array(row + 1, col    )} * 2.0;
-    case BOTTOM | LEFT:
-        return rgb_float{array(row - 1, col    )} * 2.0 +
-               rgb_float{array(row - 1, col + 1)} * 1.0 +
-               rgb_float{array(row    , col + 1)} * 2.0;
-    case BOTTOM | RIGHT:
-        return rgb_float{array(row - 1, col - 1)} * 1.0 +
-               rgb_float{array(row - 1, col    )} * 2.0 +
-               rgb_float{array(row    , col - 1)} * 2.0;
-    default:
-        return rgb_float{array(row - 1, col - 1)} * 1.0 +
-               rgb_float{array(row - 1, col    )} * 2.0 +
-               rgb_float{array(row - 1, col + 1)} * 1.0 +
-               rgb_float{array(row    , col - 1)} * 2.0 +
-               rgb_float{array(row    , col + 1)} * 2.0 +
-               rgb_float{array(row + 1, col - 1)} * 1.0 +
-               rgb_float{array(row + 1, col    )} * 2.0 +
-               rgb_float{array(row + 1, col + 1)} * 1.0;
-    } // clang-format on
-}
-
-
-// Using the sum of neighbors provided by `blur_around`, fill in a center value
-// and get the final blurred pixel.
-rgb_float
-blur_for(array2d<rgb_float> const & neighborhood, size_t pos, rgb const & center)
+// Compare the output pixels at `here` and `there`, blurred with their
+// neighborhoods, against the input. If swapping them would be a closer match,
+// swap them, along with their `output_lab` values, update the neighborhood
+// sums, and add the swap to the `tally`.
+//
+// This touches only the neighborhoods of the blur around `here` and `there`.
+template <typename Pixels, typename Blur>
+void dithered_swap(
+    Pixels & pixels,
+    Blur const & blur,
+    array2d<lab> & output_lab,
+    size_t here,
+    size_t there,
+    swap_tally & tally)
 {
-    size_t col = pos % neighborhood.cols;
-    size_t row = pos / neighborhood.cols;
-
-    // Sum this pixel with the pos to get the blurred version.
-    auto blurred = neighborhood[pos] + rgb_float {center} * 4.0;
-
-    // Determine the correct kernel normalization, based on edge adjacency.
-    // Ignore the degenerate cases where a pixel is adjacent to more than two
-    // edges, which only occur in images with a single row or column.
-    switch (edges(row, col, neighborhood.rows, neighborhood.cols))
+    auto const here_row = here / pixels.cols;
+    auto const here_col = here % pixels.cols;
+    auto const there_row = there / pixels.cols;
+    auto const there_col = there % pixels.cols;
+    auto const here_at = pixels.position(here_row, here_col);
+    auto const there_at = pixels.position(there_row, there_col);
+
+    auto const here_color = pixels.output(here_at);
+    auto const there_color = pixels.output(there_at);
+
+    // What does this output pixel look like with a little blur?  What
+    // would it look like if swapped with the other pixel?
+    auto here_now = blur.blur(pixels, here_at, here_row, here_col, here_color);
+    auto here_swapped = blur.blur(pixels, here_at, here_row, here_col, there_color);
+
+    // Ask the same two questions for the other pixel.
+    auto there_now = blur.blur(pixels, there_at, there_row, there_col, there_color);
+    auto there_swapped = blur.blur(pixels, there_at, there_row, there_col, here_color);
+
+    // Now ask, what is the sum of the squared differences between
+    // the input and output images at these two pixels, both without
+    // and with swapping? The four conversions are most of the work here, so
+    // they're done together.
+    auto const here_input = pixels.input_lab(here_at);
+    auto const there_input = pixels.input_lab(there_at);
+    auto const blurred = fast_lab({here_now, there_now, here_swapped, there_swapped});
+    auto current = diff2(blurred[0], here_input) + diff2(blurred[1], there_input);
+    auto swapped = diff2(blurred[2], here_input) + diff2(blurred[3], there_input);
+
+    if (swapped < current)
     {
-    case TOP:
-    case BOTTOM:
-    case LEFT:
-    case RIGHT:
-        return blurred * (1.0F / 12.0F);
-    case TOP | LEFT:
-    case TOP | RIGHT:
-    case BOTTOM | LEFT:
-    case BOTTOM | RIGHT:
-        return blurred * (1.0F / 9.0F);
-    default:
-        return blurred * (1.0F / 16.0F);
+        auto delta = rgb_float {here_color} - rgb_float {there_color};
+        auto nabla = rgb_float {there_color} - rgb_float {here_color};
+        blur.update(pixels, there_at, delta);
+        blur.update(pixels, here_at, nabla);
+
+        pixels.swap_output(here_at, there_at);
+
+        // The tally tracks the unblurred error, like `compare_and_swap`.
+        auto const here_lab = output_lab[here];
+        auto const there_lab = output_lab[there];
+        std::swap(output_lab[here], output_lab[there]);
+        tally.record(
+            diff2(here_lab, here_input),
+            diff2(there_lab, there_input),
+            diff2(there_lab, here_input),
+            diff2(here_lab, there_input));
     }
 }
 
 
-// When a pixel has changed by the given `delta`, update the eight neighbors
-// values accordingly.
-void update_blur(
-    array2d<rgb_float> & array, size_t neighborhood, rgb_float const & delta)
+// One round of dithering: compare and swap each pair from `rounds`, on up to
+// `threads` threads.
+template <typename Pixels, typename Blur>
+swap_tally dither_round(
+    Pixels & pixels,
+    Blur const & blur,
+    array2d<lab> & output_lab,
+    pair_rounds const & rounds,
+    unsigned threads)
 {
-    size_t col = neighborhood % array.cols;
-    size_t row = neighborhood / array.cols;
-
-    // Determine which neighbors to update, based on edge adjacency.  Ignore
-    // the degenerate cases where a pixel is adjacent to more than two edges,
-    // which only occur in images with a single row or column.
-    switch (edges(row, col, array.rows, array.cols))
-    {
-    case TOP: // clang-format off
-        array(row    , col - 1) += delta * 2.0;
-        array(row    , col + 1) += delta * 2.0;
-        array(row + 1, col - 1) += delta * 1.0;
-        array(row + 1, col    ) += delta * 2.0;
-        array(row + 1, col + 1) += delta * 1.0;
-        return;
-    case BOTTOM:
-        array(row - 1, col - 1) += delta * 1.0;
-        array(row - 1, col    ) += delta * 2.0;
-        array(row - 1, col + 1) += delta * 1.0;
-        array(row    , col - 1) += delta * 2.0;
-        array(row    , col + 1) += delta * 2.0;
-        return;
-    case LEFT:
-        array(row - 1, col    ) += delta * 2.0;
-        array(row - 1, col + 1) += delta * 1.0;
-        array(row    , col + 1) += delta * 2.0;
-        array(row + 1, col    ) += delta * 2.0;
-        array(row + 1, col + 1) += delta * 1.0;
-        return;
-    case RIGHT:
-        array(row - 1, col - 1) += delta * 1.0;
-        array(row - 1, col    ) += delta * 2.0;
-        array(row    , col - 1) += delta * 2.0;
-        array(row + 1, col - 1) += delta * 1.0;
-        array(row + 1, col    ) += delta * 2.0;
-        return;
-    case TOP | LEFT:
-        array(row    , col + 1) += delta * 2.0;
-        array(row + 1, col    ) += delta * 2.0;
-        array(row + 1, col + 1) += delta * 1.0;
-        return;
-    case TOP | RIGHT:
-        array(row    , col - 1) += delta * 2.0;
-        array(row + 1, col - 1) += delta * 1.0;
-        array(row + 1, col    ) += delta * 2.0;
-        return;
-    case BOTTOM | LEFT:
-        array(row - 1, col    ) += delta * 2.0;
-        array(row - 1, col + 1) += delta * 1.0;
-        array(row    , col + 1) += delta * 2.0;
-        return;
-    case BOTTOM | RIGHT:
-        array(row - 1, col - 1) += delta * 1.0;
-        array(row - 1, col    ) += delta * 2.0;
-        array(row    , col - 1) += delta * 2.0;
-        return;
-    default:
-        array(row - 1, col - 1) += delta * 1.0;
-        array(row - 1, col    ) += delta * 2.0;
-        array(row - 1, col + 1) += delta * 1.0;
-        array(row    , col - 1) += delta * 2.0;
-        array(row    , col + 1) += delta * 2.0;
-        array(row + 1, col - 1) += delta * 1.0;
-        array(row + 1, col    ) += delta * 2.0;
-        array(row + 1, col + 1) += delta * 1.0;
-        return;
-    } // clang-format on
+    std::vector<swap_tally> tallies(threads);
+    auto const work = [&](unsigned thread, size_t begin, size_t end) {
+        std::vector<pixel_index> scratch;
+        swap_tally tally;
+        for (auto chunk = begin; chunk < end; chunk++)
+            rounds.for_each_pair(chunk, scratch, [&](size_t here, size_t there) {
+                dithered_swap(pixels, blur, output_lab, here, there, tally);
+            });
+
+        tallies[thread] = tally;
+    };
+    parallel_for(threads, rounds.num_chunks(), work);
+
+    swap_tally total;
+    for (auto const & tally: tallies)
+        total += tally;
+
+    return total;
 }
 
-} // end anonymous namespace
-
 
-void compare_and_swap_dithered(
-    array2d<rgb> const & input,
+// `compare_and_swap_dithered`, with a blur of the given radius.
+template <int Radius>
+void dither(
     array2d<rgb> & output,
+    lab_images & labs,
     int passes,
-    permute_rng_type & rng)
+    permute_rng_type & rng,
+    swap_options const & options,
+    dither_state const * resume)
 {
-    std::vector<size_t> here_idxs(input.size());
-    std::iota(here_idxs.begin(), here_idxs.end(), 0);
-    std::vector<size_t> there_idxs(input.size());
-    std::iota(there_idxs.begin(), there_idxs.end(), 0);
+    if (resume)
+    {
+        if (resume->output.size() != output.size())
+            throw std::runtime_error("dithering state is for a different size image");
 
-    auto const input_lab = array2d<lab> {input};
+        output.data = resume->output;
+        labs.output.data = to_lab(output).data;
+    }
 
-    array2d<rgb_float> blurred_neighbors(output.rows, output.cols);
-    for (size_t i = 0; i < output.size(); i++)
-        blurred_neighbors[i] = blur_around(output, i);
+    // Swaps write to the neighborhoods around both pixels, so blocks are kept
+    // a radius apart, and only blocked pairs can be processed in parallel.
+    auto const blocked = options.pairs == pairing::blocked;
+    pair_rounds rounds {
+        options.pairs,
+        output.rows,
+        output.cols,
+        options.block_size,
+        blocked ? size_t {Radius} : 0U};
+    auto const threads = blocked ? options.threads : 1U;
+
+    // Shuffled pairs are drawn the original way: each pass shuffles the
+    // `here` and `there` pixels separately, instead of in two rounds.
+    std::vector<pixel_index> here_idxs;
+    std::vector<pixel_index> there_idxs;
+    shuffle_scratch spare;
+    if (options.pairs == pairing::shuffled and resume)
+    {
+        if (resume->here_idxs.size() != output.size() or
+            resume->there_idxs.size() != output.size())
+            throw std::runtime_error("dithering state is for different pairs");
 
-    for (int pass = 0; pass < passes; pass++)
+        here_idxs = resume->here_idxs;
+        there_idxs = resume->there_idxs;
+    }
+    else if (options.pairs == pairing::shuffled)
     {
-        std::shuffle(here_idxs.begin(), here_idxs.end(), rng);
-        std::shuffle(there_idxs.begin(), there_idxs.end(), rng);
+        check_pixel_index(output.size());
+        here_idxs.resize(output.size());
+        std::iota(here_idxs.begin(), here_idxs.end(), 0);
+        there_idxs.resize(output.size());
+        std::iota(there_idxs.begin(), there_idxs.end(), 0);
+    }
 
-        int num_swaps = 0;
+    dither_pixels<default_pixel_layout> pixels {output, labs.input, Radius, threads};
+    tent_blur<Radius> const blur {output.rows, output.cols, pixels.stride()};
+    for (size_t i = 0; i < output.size(); i++)
+    {
+        auto const at = pixels.position(i);
+        pixels.add_to_neighbors(at, blur.around(pixels, at));
+    }
 
-        for (size_t i = 0; i < here_idxs.size(); i++)
+    error_tracker errors {output.size()};
+    for (size_t i = 0; i < output.size(); i++)
+        errors.add_pixel(diff2(labs.output[i], labs.input[i]));
+
+    // The error of the output doesn't depend on how it got there, so only the
+    // counts carry over.
+    int const first_pass = resume ? resume->passes_done : 0;
+    if (resume)
+        errors.resume(first_pass, resume->total_swaps);
+
+    // Save just enough to carry on later.
+    auto const save_checkpoint = [&](int passes_done, size_t total_swaps) {
+        array2d<rgb> snapshot(output.rows, output.cols);
+        pixels.write_output(snapshot);
+        options.checkpoint(
+            {passes_done,
+             total_swaps,
+             rng.serialize(),
+             std::move(snapshot.data),
+             here_idxs,
+             there_idxs});
+    };
+
+    for (int pass = first_pass; pass < passes; pass++)
+    {
+        pass_timer timer;
+        swap_tally tally;
+
+        if (options.pairs != pairing::shuffled)
         {
-            auto here = here_idxs[i];
-            auto there = there_idxs[i];
-
-            // The access pattern is random, but known in advance. Prefetching
-            // reduces execution time by ~25%.
-            constexpr int ahead = 4;
-            auto future_here = i < here_idxs.size() ? here_idxs[i + ahead] : 0;
-            auto future_there = i < there_idxs.size() ? there_idxs[i + ahead] : 0;
-            __builtin_prefetch(&output[future_here]); // NOLINT
-            __builtin_prefetch(&output[future_there]); // NOLINT
-            __builtin_prefetch(&blurred_neighbors[future_here]); // NOLINT
-            __builtin_prefetch(&blurred_neighbors[future_there]); // NOLINT
-            __builtin_prefetch(&input_lab[future_here]); // NOLINT
-            __builtin_prefetch(&input_lab[future_there]); // NOLINT
-
-            // What does this output pixel look like with a little blur?  What
-            // would it look like if swapped with the other pixel?
-            auto here_now = blur_for(blurred_neighbors, here, output[here]);
-            auto here_swapped = blur_for(blurred_neighbors, here, output[there]);
-
-            // Ask the same two questions for the other pixel.
-            auto there_now = blur_for(blurred_neighbors, there, output[there]);
-            auto there_swapped = blur_for(blurred_neighbors, there, output[here]);
-
-            // Now ask, what is the sum of the squared differences between
-            // the input and output images at these two pixels, both without
-            // and with swapping?
-            auto current = diff2(lab {here_now}, input_lab[here]) +
-                diff2(lab {there_now}, input_lab[there]);
-            auto swapped = diff2(lab {here_swapped}, input_lab[here]) +
-                diff2(lab {there_swapped}, input_lab[there]);
-
-            if (swapped < current)
+            // Two rounds, so that each pixel is compared about twice per
+            // pass, as below.
+            for (int round = 0; round < 2; round++)
             {
-                auto delta = rgb_float {output[here]} - rgb_float {output[there]};
-                auto nabla = rgb_float {output[there]} - rgb_float {output[here]};
-                update_blur(blurred_neighbors, there, delta);
-                update_blur(blurred_neighbors, here, nabla);
-
-                std::swap(output[here], output[there]);
-                num_swaps++;
+                timer.choose_pairs([&] { rounds.next_round(rng, options.threads); });
+                tally += dither_round(pixels, blur, labs.output, rounds, threads);
             }
         }
+        else
+        {
+            // The shuffles run on every thread, even though the swaps can't.
+            timer.choose_pairs([&] {
+                shuffle_indices(here_idxs, spare, rng, options.threads);
+                shuffle_indices(there_idxs, spare, rng, options.threads);
+            });
 
-        double swap_freq = num_swaps / static_cast<double>(output.size());
-        std::cout << "pass " << pass << ": ";
-        std::cout << num_swaps << '/' << output.size() << " " << swap_freq;
+            for (size_t i = 0; i < here_idxs.size(); i++)
+            {
+                // The access pattern is random, but known in advance.
+                // Prefetching reduces execution time by ~25%.
+                constexpr size_t ahead = 4;
+                if (i + ahead < here_idxs.size())
+                {
+                    pixels.prefetch(pixels.position(here_idxs[i + ahead]));
+                    pixels.prefetch(pixels.position(there_idxs[i + ahead]));
+                }
+
+                dithered_swap(
+                    pixels, blur, labs.output, here_idxs[i], there_idxs[i], tally);
+            }
+        }
 
-        if (pass % 10 == 0)
+        auto const previous = errors.report();
+        auto const report = timer.timed(errors.finish_pass(tally));
+        auto const passes_done = pass + 1;
+        if (options.snapshots and options.snapshot_interval > 0 and
+            passes_done % options.snapshot_interval == 0)
         {
-            float accum = 0;
-            for (size_t i = 0; i < output.size(); i++)
-                accum += diff2(lab {output[i]}, input_lab[i]);
-
-            float rms = std::sqrt(accum / static_cast<float>(output.size()));
-            std::cout << " rms: " << rms;
+            options.snapshots->offer(
+                passes_done, output.rows, output.cols, [&](array2d<rgb> & snapshot) {
+                    pixels.write_output(snapshot);
+                });
         }
 
-        std::cout << '\n';
+        if (finish_pass(options, previous, report))
+            break;
+
+        if (options.checkpoint and options.checkpoint_interval > 0 and
+            passes_done % options.checkpoint_interval == 0 and passes_done < passes)
+            save_checkpoint(passes_done, report.total_swaps);
+    }
+
+    pixels.write_output(output);
+}
+
+} // end anonymous namespace
+
+
+void compare_and_swap_dithered(
+    array2d<rgb> const & input,
+    array2d<rgb> & output,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options)
+{
+    lab_images labs {input, output};
+    compare_and_swap_dithered(output, labs, passes, rng, options);
+}
+
+
+void compare_and_swap_dithered(
+    array2d<rgb> & output,
+    lab_images & labs,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options,
+    dither_state const * resume)
+{
+    switch (options.dither_radius)
+    {
+    case 1:
+        dither<1>(output, labs, passes, rng, options, resume);
+        return;
+    case 2:
+        dither<2>(output, labs, passes, rng, options, resume);
+        return;
+    default:
+        throw std::runtime_error("dithering radius must be 1 or 2");
     }
 }
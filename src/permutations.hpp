@@ -1,21 +1,123 @@
 #ifndef PERMUTATIONS_HPP
 #define PERMUTATIONS_HPP
 
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <vector>
+
 #include <XoshiroCpp.hpp>
 
 #include "array2d.hpp"
 #include "colors.hpp"
+#include "error_tracker.hpp"
+#include "pairing.hpp"
 
 
 using permute_rng_type = XoshiroCpp::Xoshiro256StarStar;
 
+class snapshot_writer;
+
+// Convert an image to CIELAB. Large images (at least 2^22 pixels) are
+// converted through the shared `lab_table`, building it if needed; smaller
+// images use the table only if something else already built it.
+array2d<lab> to_lab(array2d<rgb> const & image);
+
+
+// The CIELAB values of an input image, and of an output image as the engines
+// below permute it. Running several engines on the same images, each one can
+// pick up where the last left off, instead of converting both images again.
+struct lab_images
+{
+    lab_images(array2d<rgb> const & input, array2d<rgb> const & output);
+
+    array2d<lab> input;
+    array2d<lab> output;
+};
+
+// Where a run of `compare_and_swap_dithered` stands at the end of a pass:
+// enough to carry on from there, with the same results as if it never stopped.
+struct dither_state
+{
+    int passes_done = 0;
+    size_t total_swaps = 0;
+    permute_rng_type::state_type rng {};
+
+    // The output pixels, in row-major order.
+    std::vector<rgb> output;
+
+    // With `pairing::shuffled`, each pass reshuffles the last pass's order of
+    // pixels, so that has to be kept too. Otherwise these are empty.
+    std::vector<pixel_index> here_idxs;
+    std::vector<pixel_index> there_idxs;
+};
+
+
+// Settings for the swap engines, `compare_and_swap`, `compare_and_swap_coarse`,
+// and `compare_and_swap_dithered`.
+struct swap_options
+{
+    // How many threads to run on. The results don't depend on this.
+    unsigned threads = 1;
+
+    // How to choose the pairs of pixels to compare; see pairing.hpp.
+    pairing pairs = pairing::shuffled;
+
+    // The side of the square blocks for `pairing::blocked`.
+    size_t block_size = 256;
+
+    // How far the blur of `compare_and_swap_dithered` reaches: 1 for the 3x3
+    // Gaussian, or 2 for a 5x5 kernel, which dithers more coarsely.
+    int dither_radius = 1;
+
+    // The side of the square blocks that `compare_and_swap_coarse` starts
+    // moving colors between.
+    size_t coarse_block_size = 8;
+
+    // Stop before running all the passes, at the end of the first pass that
+    // swaps fewer than this fraction of the pixels...
+    double min_swap_rate = 0;
+
+    // ...or that improves the RMS error by less than this...
+    double min_rms_gain = 0;
+
+    // ...or that ends after this time.
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+
+    // If set, called at the end of every pass.
+    progress_callback progress;
+
+    // If set, `compare_and_swap_dithered` calls this at the end of every
+    // `checkpoint_interval` passes, except the last.
+    std::function<void(dither_state const &)> checkpoint;
+    int checkpoint_interval = 0;
+
+    // If set, `compare_and_swap_dithered` hands `snapshots` a copy of the
+    // output at the end of every `snapshot_interval` passes; see snapshot.hpp.
+    snapshot_writer * snapshots = nullptr;
+    int snapshot_interval = 0;
+};
+
+
 // Permute the pixels in the `output` image to more closely resemble the
 // `reference` image, based on brightness.
 //
 // After exeuction, the n-th brightest pixel in `output` is in the same
 // position as the n-th brightest pixel in the `input` image. This ignores
 // all aspects of color other than brightness.
-void match_ascending(array2d<rgb> const & input, array2d<rgb> & output);
+//
+// Brightness is CIELAB lightness, to a resolution of about 0.0015. This sorts
+// without comparisons, on up to `threads` threads, and needs about six bytes
+// of scratch memory per pixel.
+void match_ascending(
+    array2d<rgb> const & input, array2d<rgb> & output, unsigned threads = 1);
+
+// As above, moving the CIELAB values of the output along with its pixels.
+void match_ascending(
+    array2d<rgb> const & input,
+    array2d<rgb> & output,
+    lab_images & labs,
+    unsigned threads = 1);
 
 
 // Permute the pixels in the `output` image to more closely resemble the
@@ -32,7 +134,47 @@ void compare_and_swap(
     array2d<rgb> const & input,
     array2d<rgb> & output,
     int passes,
-    permute_rng_type & rng);
+    permute_rng_type & rng,
+    swap_options const & options = {});
+
+// As above, starting from, and updating, the CIELAB values in `labs`. With the
+// `compact` pixel layout, the output values come back rounded to 1/128.
+void compare_and_swap(
+    array2d<rgb> & output,
+    lab_images & labs,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options = {});
+
+
+// Permute the pixels in the `output` image to resemble the `reference` image
+// at a coarse scale, as a cheap start for the engines above and below.
+//
+// Cut the image into square blocks, and the output's colors into groups of
+// neighbors along the Hilbert curve, one for each block and of its size. Then
+// compare and swap whole groups between blocks of the same size, by the mean
+// color of each group and of each block's input pixels; a pass is one
+// compare-and-swap per block. Then lay out each group in its block, in the
+// order of the block's input lightness. Run `passes` passes like that, then
+// halve the blocks, with each group the colors already in its block, and so
+// on down to blocks of 2x2.
+//
+// The passes run on one thread, and the results don't depend on `threads`.
+// Progress reports the RMS error between the means, over the blocks.
+void compare_and_swap_coarse(
+    array2d<rgb> const & input,
+    array2d<rgb> & output,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options = {});
+
+// As above, starting from, and updating, the CIELAB values in `labs`.
+void compare_and_swap_coarse(
+    array2d<rgb> & output,
+    lab_images & labs,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options = {});
 
 
 // Permute the pixels in the `output` image to more closely resemble the
@@ -41,10 +183,28 @@ void compare_and_swap(
 // As `compare_and_swap`, but instead of comparing output pixels directly to
 // their corresponding input pixels, compare them to the average color of a
 // small region around the input pixel.
+//
+// Only `pairing::blocked` runs on more than one thread: swapping a pixel
+// updates the blur around it, so pairs are only drawn from the interior of
+// each block, keeping the blocks' neighborhoods apart.
 void compare_and_swap_dithered(
     array2d<rgb> const & input,
     array2d<rgb> & output,
     int passes,
-    permute_rng_type & rng);
+    permute_rng_type & rng,
+    swap_options const & options = {});
+
+// As above, starting from, and updating, the CIELAB values in `labs`.
+//
+// Given a `resume` state, carry on from it instead: replace the output, and
+// its values in `labs`, with the state's, and run the passes after it. The
+// caller restores `rng` from the state.
+void compare_and_swap_dithered(
+    array2d<rgb> & output,
+    lab_images & labs,
+    int passes,
+    permute_rng_type & rng,
+    swap_options const & options = {},
+    dither_state const * resume = nullptr);
 
 #endif
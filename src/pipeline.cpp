@@ -0,0 +1,239 @@
+#include "pipeline.hpp"
+
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+
+namespace {
+
+char const * engine_name(stage::engine kind)
+{
+    switch (kind)
+    {
+    case stage::engine::ascending:
+        return "ascending";
+    case stage::engine::coarse:
+        return "coarse";
+    case stage::engine::swap:
+        return "swap";
+    case stage::engine::dither:
+        return "dither";
+    }
+
+    return "";
+}
+
+} // anonymous namespace
+
+
+bool parse_stages(std::string const & list, std::vector<stage> & stages)
+{
+    std::vector<stage> parsed;
+    std::istringstream in {list};
+    std::string name;
+    while (std::getline(in, name, ','))
+    {
+        if (name == "a")
+        {
+            parsed.push_back({stage::engine::ascending});
+            continue;
+        }
+
+        stage next {};
+        if (name.size() < 2)
+            return false;
+
+        switch (name[0])
+        {
+        case 'c':
+            next.kind = stage::engine::coarse;
+            break;
+        case 's':
+            next.kind = stage::engine::swap;
+            break;
+        case 'd':
+            next.kind = stage::engine::dither;
+            break;
+        default:
+            return false;
+        }
+
+        // All of the rest must be the number of passes.
+        std::istringstream passes {name.substr(1)};
+        if (not (passes >> next.passes) or not passes.eof() or next.passes < 0)
+            return false;
+
+        parsed.push_back(next);
+    }
+
+    if (parsed.empty())
+        return false;
+
+    stages = std::move(parsed);
+    return true;
+}
+
+
+pipeline::pipeline(
+    array2d<rgb> const & input, array2d<rgb> & output, swap_options options)
+    : input {input}, output {output}, options {std::move(options)}
+{ }
+
+
+void pipeline::run(std::vector<stage> const & stages, permute_rng_type & rng)
+{
+    for (size_t i = 0; i < stages.size(); i++)
+        run(i, stages[i], rng);
+
+    finish_snapshots();
+}
+
+
+void pipeline::resume(
+    std::vector<stage> const & stages,
+    checkpoint const & from,
+    permute_rng_type & rng)
+{
+    if (from.stage >= stages.size() or
+        stages[from.stage].kind != stage::engine::dither or
+        from.dither.passes_done > stages[from.stage].passes)
+        throw std::runtime_error("checkpoint is from different stages");
+    if (from.rows != output.rows or from.cols != output.cols)
+        throw std::runtime_error("checkpoint is for a different size image");
+    if (from.pairs != options.pairs or from.dither_radius != options.dither_radius or
+        (from.pairs == pairing::blocked and from.block_size != options.block_size))
+        throw std::runtime_error("checkpoint is from different dithering options");
+
+    rng.deserialize(from.dither.rng);
+    resume_from = &from.dither;
+    for (auto i = from.stage; i < stages.size(); i++)
+        run(i, stages[i], rng);
+
+    finish_snapshots();
+}
+
+
+void pipeline::save_checkpoints(std::string filename, int interval)
+{
+    checkpoint_name = std::move(filename);
+    options.checkpoint_interval = interval;
+}
+
+
+void pipeline::save_snapshots(std::string filename, int interval, png_options png)
+{
+    snapshots = std::make_unique<snapshot_writer>(std::move(filename), png);
+    options.snapshots = snapshots.get();
+    options.snapshot_interval = interval;
+}
+
+
+void pipeline::record_stats(run_stats & run)
+{
+    stats = &run;
+}
+
+
+void pipeline::run(size_t index, stage const & next, permute_rng_type & rng)
+{
+    // Convert the images first, so that it's timed apart from the stage.
+    if (next.kind != stage::engine::ascending)
+        labs();
+
+    auto stage_options = options;
+    auto const name = engine_name(next.kind);
+    std::optional<run_stats::scoped_timer> timer;
+    if (stats)
+    {
+        timer.emplace(*stats, name);
+        stage_options.progress = [&](pass_report const & report) {
+            if (options.progress)
+                options.progress(report);
+
+            stats->add_pass(
+                {name,
+                 report.pass,
+                 report.swaps,
+                 report.swap_rate(),
+                 report.rms(),
+                 report.seconds,
+                 report.shuffle_seconds});
+        };
+    }
+
+    switch (next.kind)
+    {
+    case stage::engine::ascending:
+        if (shared_labs)
+            match_ascending(input, output, *shared_labs, options.threads);
+        else
+            match_ascending(input, output, options.threads);
+        return;
+
+    case stage::engine::coarse:
+        compare_and_swap_coarse(output, labs(), next.passes, rng, stage_options);
+        return;
+
+    case stage::engine::swap:
+        compare_and_swap(output, labs(), next.passes, rng, stage_options);
+        return;
+
+    case stage::engine::dither:
+    {
+        if (not checkpoint_name.empty())
+        {
+            stage_options.checkpoint = [&](dither_state const & state) {
+                std::optional<run_stats::scoped_timer> saving;
+                if (stats)
+                    saving.emplace(*stats, "checkpoint");
+
+                checkpoint const saved {
+                    index,
+                    output.rows,
+                    output.cols,
+                    state,
+                    options.pairs,
+                    options.block_size,
+                    options.dither_radius};
+                save_checkpoint(saved, checkpoint_name);
+            };
+        }
+
+        auto const * const from = std::exchange(resume_from, nullptr);
+        compare_and_swap_dithered(
+            output, labs(), next.passes, rng, stage_options, from);
+        return;
+    }
+    }
+}
+
+
+void pipeline::finish_snapshots()
+{
+    if (not snapshots)
+        return;
+
+    // Only what's left of the last snapshot holds up the run.
+    std::optional<run_stats::scoped_timer> timer;
+    if (stats)
+        timer.emplace(*stats, "snapshots");
+
+    snapshots->wait();
+}
+
+
+lab_images & pipeline::labs()
+{
+    if (not shared_labs)
+    {
+        std::optional<run_stats::scoped_timer> timer;
+        if (stats)
+            timer.emplace(*stats, "lab");
+
+        shared_labs.emplace(input, output);
+    }
+
+    return *shared_labs;
+}
@@ -0,0 +1,97 @@
+// Running several permutation engines in a row, on the same pair of images.
+//
+// Each engine in permutations.hpp converts both images to CIELAB before it
+// starts. A pipeline converts them once, and hands the CIELAB values from
+// each stage to the next, with the output's kept in step as its pixels move.
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "array2d.hpp"
+#include "checkpoint.hpp"
+#include "colors.hpp"
+#include "image.hpp"
+#include "permutations.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+
+
+// One step of a pipeline: an engine, and how many passes it runs.
+struct stage
+{
+    enum class engine
+    {
+        ascending,
+        coarse,
+        swap,
+        dither
+    };
+
+    engine kind;
+    int passes = 0;
+};
+
+// Parse a comma-separated list of stages: `a` for `match_ascending`, and then
+// a number of passes after `c` for `compare_and_swap_coarse`, `s` for
+// `compare_and_swap`, and `d` for `compare_and_swap_dithered`, e.g.
+// "c100,s20,d200". Return false if it isn't one.
+bool parse_stages(std::string const & list, std::vector<stage> & stages);
+
+
+// Permutes an output image to resemble an input image, one stage at a time.
+class pipeline
+{
+public:
+    // Both images must outlive the pipeline.
+    pipeline(
+        array2d<rgb> const & input, array2d<rgb> & output, swap_options options);
+
+    // Run the stages in order, each on the output of the last.
+    void run(std::vector<stage> const & stages, permute_rng_type & rng);
+
+    // Carry on running `stages` from a checkpoint saved while running them,
+    // skipping the stages before it. This restores `rng` too, and ends with
+    // the same output as if the run had never stopped.
+    void resume(
+        std::vector<stage> const & stages,
+        checkpoint const & from,
+        permute_rng_type & rng);
+
+    // Save a checkpoint to `filename` every `interval` passes of dithering.
+    void save_checkpoints(std::string filename, int interval);
+
+    // Write a snapshot of the output to `filename` every `interval` passes of
+    // dithering, in the background; see snapshot.hpp. Running the stages
+    // waits for the last snapshot to be written, and throws if any failed.
+    void save_snapshots(std::string filename, int interval, png_options png);
+
+    // Time the CIELAB conversion, each stage, and each checkpoint, and record
+    // every pass, in `stats`, which must outlive the pipeline.
+    void record_stats(run_stats & stats);
+
+private:
+    void run(size_t index, stage const & next, permute_rng_type & rng);
+    void finish_snapshots();
+
+    // Convert the images on first use: a pipeline that only matches lightness
+    // never needs them.
+    lab_images & labs();
+
+    array2d<rgb> const & input;
+    array2d<rgb> & output;
+    swap_options options;
+    std::optional<lab_images> shared_labs;
+    std::string checkpoint_name;
+    std::unique_ptr<snapshot_writer> snapshots;
+    run_stats * stats = nullptr;
+
+    // Where to pick up a dithering stage, while resuming.
+    dither_state const * resume_from = nullptr;
+};
+
+#endif
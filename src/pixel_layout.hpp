@@ -0,0 +1,425 @@
+// Memory layouts for the per-pixel state of the swap kernels.
+//
+// The kernels in permutations.cpp visit pixels in a random order, so every
+// array they read costs a cache miss per pixel. The `split` layout keeps each
+// kind of state in its own array. The other two pack all of a pixel's state
+// into one aligned record, so that each pixel costs a single cache line:
+// `packed` keeps full precision in 32 bytes, and `compact` fits in 16 bytes by
+// storing CIELAB in 16-bit fixed point.
+//
+// The layout is chosen at compile time, with the PIXEL_LAYOUT option in
+// src/CMakeLists.txt.
+
+#ifndef PIXEL_LAYOUT_HPP
+#define PIXEL_LAYOUT_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "array2d.hpp"
+#include "colors.hpp"
+#include "parallel.hpp"
+
+
+enum class pixel_layout
+{
+    split,
+    packed,
+    compact
+};
+
+#ifndef PIXEL_LAYOUT
+#define PIXEL_LAYOUT packed
+#endif
+
+constexpr pixel_layout default_pixel_layout = pixel_layout::PIXEL_LAYOUT;
+
+constexpr std::size_t cache_line_size = 64;
+
+
+// The state arrays are allocated untouched, and filled in in bands of rows on
+// up to `threads` threads, split like the blocks of `pairing::blocked` are
+// between the threads of each round. Each band's memory then starts out on the
+// NUMA node of the thread that fills it, which, with `set_thread_pinning`, is
+// the node whose threads go on to swap most of the pixels in it.
+template <typename T>
+using state_allocator = first_touch_allocator<T, aligned_allocator<T, cache_line_size>>;
+
+// Set element `i` of `array`, in row-major order, to `value(i)`.
+template <typename T, typename A, typename Value>
+void fill_rows(array2d<T, A> & array, unsigned threads, Value const & value)
+{
+    parallel_for(threads, array.rows, [&](unsigned, size_t begin, size_t end) {
+        for (auto i = begin * array.cols; i < end * array.cols; i++)
+            array[i] = value(i);
+    });
+}
+
+// As above, and value-initialize the border, each band taking the border
+// beside it.
+template <typename T, typename A, typename Value>
+void fill_rows(padded_array2d<T, A> & array, unsigned threads, Value const & value)
+{
+    auto const padded_row = [&](size_t row) {
+        return array.data.begin() + static_cast<std::ptrdiff_t>(row * array.stride);
+    };
+
+    // With more threads than rows, several bands would start at row zero, and
+    // all take the border above.
+    threads = static_cast<unsigned>(
+        std::min<size_t>(threads, std::max<size_t>(array.rows, 1)));
+    parallel_for(threads, array.rows, [&](unsigned, size_t begin, size_t end) {
+        // The first band takes the border rows above the image too, and the
+        // last band those below it.
+        auto const top = (begin == 0) ? 0 : begin + array.border;
+        auto const bottom = (end == array.rows) ? end + 2 * array.border
+                                                : end + array.border;
+        for (auto row = top; row < bottom; row++)
+        {
+            if (row < array.border or row >= array.rows + array.border)
+            {
+                std::fill(padded_row(row), padded_row(row + 1), T {});
+                continue;
+            }
+
+            auto const first = (row - array.border) * array.cols;
+            auto out = std::fill_n(padded_row(row), array.border, T {});
+            for (size_t col = 0; col < array.cols; col++)
+                *out++ = value(first + col);
+            std::fill_n(out, array.border, T {});
+        }
+    });
+}
+
+
+// A sum of 8-bit colors with small integer weights, like the neighborhood
+// sums used in dithering. These are always integers below 2^15, so 16 bits per
+// channel store them exactly.
+struct rgb_sum16
+{
+    rgb_sum16() noexcept = default;
+
+    explicit rgb_sum16(rgb_float const & sum) noexcept
+        : r {static_cast<int16_t>(std::lround(sum.r))}
+        , g {static_cast<int16_t>(std::lround(sum.g))}
+        , b {static_cast<int16_t>(std::lround(sum.b))}
+    { }
+
+    operator rgb_float() const noexcept // NOLINT
+    {
+        return {static_cast<float>(r), static_cast<float>(g), static_cast<float>(b)};
+    }
+
+    rgb_sum16 & operator+=(rgb_float const & delta) noexcept
+    {
+        r = static_cast<int16_t>(r + std::lround(delta.r));
+        g = static_cast<int16_t>(g + std::lround(delta.g));
+        b = static_cast<int16_t>(b + std::lround(delta.b));
+        return *this;
+    }
+
+    int16_t r, g, b;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// The state of `compare_and_swap`: each output pixel, and the CIELAB values of
+// both it and the corresponding input pixel.
+
+class split_swap_pixels
+{
+public:
+    split_swap_pixels(
+        array2d<rgb> const & output,
+        array2d<lab> input_lab,
+        array2d<lab> output_lab,
+        unsigned /* threads */ = 1)
+        : input_labs {std::move(input_lab)}
+        , output_labs {std::move(output_lab)}
+        , outputs {output}
+    { }
+
+    lab input_lab(size_t i) const
+    {
+        return input_labs[i];
+    }
+
+    lab output_lab(size_t i) const
+    {
+        return output_labs[i];
+    }
+
+    void swap(size_t i, size_t j)
+    {
+        std::swap(outputs[i], outputs[j]);
+        std::swap(output_labs[i], output_labs[j]);
+    }
+
+    void write_output(array2d<rgb> & output, array2d<lab> & output_lab) const
+    {
+        output.data = outputs.data;
+        output_lab.data = output_labs.data;
+    }
+
+private:
+    array2d<lab> input_labs;
+    array2d<lab> output_labs;
+    array2d<rgb> outputs;
+};
+
+
+template <typename Lab, std::size_t Size>
+class packed_swap_pixels
+{
+public:
+    packed_swap_pixels(
+        array2d<rgb> const & output,
+        array2d<lab> const & input_lab,
+        array2d<lab> const & output_lab,
+        unsigned threads = 1)
+        : records(output.rows, output.cols)
+    {
+        fill_rows(records, threads, [&](size_t i) {
+            return record {Lab {input_lab[i]}, Lab {output_lab[i]}, output[i]};
+        });
+    }
+
+    lab input_lab(size_t i) const
+    {
+        return records[i].input_lab;
+    }
+
+    lab output_lab(size_t i) const
+    {
+        return records[i].output_lab;
+    }
+
+    void swap(size_t i, size_t j)
+    {
+        std::swap(records[i].output_lab, records[j].output_lab);
+        std::swap(records[i].output, records[j].output);
+    }
+
+    void write_output(array2d<rgb> & output, array2d<lab> & output_lab) const
+    {
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            output[i] = records[i].output;
+            output_lab[i] = records[i].output_lab;
+        }
+    }
+
+private:
+    struct alignas(Size) record
+    {
+        Lab input_lab;
+        Lab output_lab;
+        rgb output;
+    };
+    static_assert(sizeof(record) == Size, "swap records should be packed");
+
+    array2d<record, state_allocator<record>> records;
+};
+
+
+template <pixel_layout Layout>
+using swap_pixels = std::conditional_t<
+    Layout == pixel_layout::split,
+    split_swap_pixels,
+    std::conditional_t<
+        Layout == pixel_layout::packed,
+        packed_swap_pixels<lab, 32>,
+        packed_swap_pixels<lab16, 16>>>;
+
+
+//////////////////////////////////////////////////////////////////////////////
+// The state of `compare_and_swap_dithered`: each output pixel, the weighted
+// sum of its neighbors, and the CIELAB value of the corresponding input pixel.
+// The neighbor sums start at zero.
+//
+// The state is stored with a border of `border` pixels all around, so that
+// the blur can read and update neighbors past the edges of the image without
+// checking for them; see tent_blur.hpp. The border pixels are black, and their
+// sums are never read. Pixels are addressed by their `position` in the padded
+// storage, where rows are `stride()` apart.
+
+class split_dither_pixels
+{
+public:
+    split_dither_pixels(
+        array2d<rgb> const & output,
+        array2d<lab> const & input_lab,
+        size_t border,
+        unsigned threads = 1)
+        : rows {output.rows}
+        , cols {output.cols}
+        , input_labs(output.rows, output.cols, border)
+        , neighbor_sums(output.rows, output.cols, border)
+        , outputs(output.rows, output.cols, border)
+    {
+        fill_rows(input_labs, threads, [&](size_t i) { return input_lab[i]; });
+        fill_rows(neighbor_sums, threads, [](size_t) { return rgb_float {0, 0, 0}; });
+        fill_rows(outputs, threads, [&](size_t i) { return output[i]; });
+    }
+
+    size_t position(size_t i) const
+    {
+        return outputs.index(i);
+    }
+
+    size_t position(size_t row, size_t col) const
+    {
+        return outputs.index(row, col);
+    }
+
+    size_t stride() const
+    {
+        return outputs.stride;
+    }
+
+    lab input_lab(size_t at) const
+    {
+        return input_labs[at];
+    }
+
+    rgb output(size_t at) const
+    {
+        return outputs[at];
+    }
+
+    rgb_float neighbors(size_t at) const
+    {
+        return neighbor_sums[at];
+    }
+
+    void add_to_neighbors(size_t at, rgb_float const & delta)
+    {
+        neighbor_sums[at] += delta;
+    }
+
+    void swap_output(size_t at, size_t other)
+    {
+        std::swap(outputs[at], outputs[other]);
+    }
+
+    void prefetch(size_t at) const
+    {
+        __builtin_prefetch(&outputs[at]); // NOLINT
+        __builtin_prefetch(&neighbor_sums[at]); // NOLINT
+        __builtin_prefetch(&input_labs[at]); // NOLINT
+    }
+
+    void write_output(array2d<rgb> & output) const
+    {
+        for (size_t i = 0; i < output.size(); i++)
+            output[i] = outputs[position(i)];
+    }
+
+    size_t const rows;
+    size_t const cols;
+
+private:
+    padded_array2d<lab, state_allocator<lab>> input_labs;
+    padded_array2d<rgb_float, state_allocator<rgb_float>> neighbor_sums;
+    padded_array2d<rgb, state_allocator<rgb>> outputs;
+};
+
+
+template <typename Lab, typename Sum, std::size_t Size>
+class packed_dither_pixels
+{
+public:
+    packed_dither_pixels(
+        array2d<rgb> const & output,
+        array2d<lab> const & input_lab,
+        size_t border,
+        unsigned threads = 1)
+        : rows {output.rows}
+        , cols {output.cols}
+        , records(output.rows, output.cols, border)
+    {
+        fill_rows(records, threads, [&](size_t i) {
+            return record {Lab {input_lab[i]}, Sum {rgb_float {0, 0, 0}}, output[i]};
+        });
+    }
+
+    size_t position(size_t i) const
+    {
+        return records.index(i);
+    }
+
+    size_t position(size_t row, size_t col) const
+    {
+        return records.index(row, col);
+    }
+
+    size_t stride() const
+    {
+        return records.stride;
+    }
+
+    lab input_lab(size_t at) const
+    {
+        return records[at].input_lab;
+    }
+
+    rgb output(size_t at) const
+    {
+        return records[at].output;
+    }
+
+    rgb_float neighbors(size_t at) const
+    {
+        return records[at].neighbors;
+    }
+
+    void add_to_neighbors(size_t at, rgb_float const & delta)
+    {
+        records[at].neighbors += delta;
+    }
+
+    void swap_output(size_t at, size_t other)
+    {
+        std::swap(records[at].output, records[other].output);
+    }
+
+    void prefetch(size_t at) const
+    {
+        __builtin_prefetch(&records[at]); // NOLINT
+    }
+
+    void write_output(array2d<rgb> & output) const
+    {
+        for (size_t i = 0; i < output.size(); i++)
+            output[i] = records[position(i)].output;
+    }
+
+    size_t const rows;
+    size_t const cols;
+
+private:
+    struct alignas(Size) record
+    {
+        Lab input_lab;
+        Sum neighbors;
+        rgb output;
+    };
+    static_assert(sizeof(record) == Size, "dither records should be packed");
+
+    padded_array2d<record, state_allocator<record>> records;
+};
+
+
+template <pixel_layout Layout>
+using dither_pixels = std::conditional_t<
+    Layout == pixel_layout::split,
+    split_dither_pixels,
+    std::conditional_t<
+        Layout == pixel_layout::packed,
+        packed_dither_pixels<lab, rgb_float, 32>,
+        packed_dither_pixels<lab16, rgb_sum16, 16>>>;
+
+#endif
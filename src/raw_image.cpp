@@ -0,0 +1,210 @@
+#include "raw_image.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+
+
+static_assert(sizeof(rgb) == 3, "raw rows should be packed 8-bit RGB");
+
+
+namespace {
+
+constexpr std::array<char, 8> magic {'R', 'A', 'W', 'R', 'G', 'B', '2', '4'};
+constexpr size_t header_size = 24;
+
+using header = std::array<unsigned char, header_size>;
+
+
+struct file_closer
+{
+    void operator()(std::FILE * file) const
+    {
+        std::fclose(file); // NOLINT
+    }
+};
+
+using file_ptr = std::unique_ptr<std::FILE, file_closer>;
+
+
+void put_u64(unsigned char * bytes, uint64_t value)
+{
+    for (unsigned i = 0; i < 8; i++)
+        bytes[i] = static_cast<unsigned char>(value >> (8 * i)); // NOLINT
+}
+
+
+uint64_t get_u64(unsigned char const * bytes)
+{
+    uint64_t value = 0;
+    for (unsigned i = 0; i < 8; i++)
+        value |= uint64_t {bytes[i]} << (8 * i); // NOLINT
+
+    return value;
+}
+
+
+header make_header(size_t rows, size_t cols)
+{
+    header bytes {};
+    std::memcpy(bytes.data(), magic.data(), magic.size());
+    put_u64(bytes.data() + 8, rows); // NOLINT
+    put_u64(bytes.data() + 16, cols); // NOLINT
+    return bytes;
+}
+
+
+bool has_magic(unsigned char const * bytes)
+{
+    return std::memcmp(bytes, magic.data(), magic.size()) == 0;
+}
+
+
+// Check the header against the size of the whole file, and return the rows
+// and columns it gives.
+std::pair<size_t, size_t> parse_header(unsigned char const * bytes, size_t file_size)
+{
+    if (file_size < header_size or not has_magic(bytes))
+        throw std::runtime_error("not a raw image");
+
+    auto const rows = get_u64(bytes + 8); // NOLINT
+    auto const cols = get_u64(bytes + 16); // NOLINT
+    // An empty image has neither rows nor columns, never just one of them.
+    if ((rows == 0) != (cols == 0))
+        throw std::runtime_error("raw image has an empty dimension");
+    // Divide first, so that a corrupt header can't overflow.
+    if (cols != 0 and rows > std::numeric_limits<size_t>::max() / sizeof(rgb) / cols)
+        throw std::runtime_error("raw image is the wrong size");
+    if (rows * cols * sizeof(rgb) != file_size - header_size)
+        throw std::runtime_error("raw image is the wrong size");
+
+    return {rows, cols};
+}
+
+} // anonymous namespace
+
+
+bool is_raw_image(char const * filename)
+{
+    file_ptr const file {std::fopen(filename, "rb")};
+    header bytes {};
+    return file and
+        std::fread(bytes.data(), 1, magic.size(), file.get()) == magic.size() and
+        has_magic(bytes.data());
+}
+
+
+bool is_raw_name(char const * filename)
+{
+    std::string const name {filename};
+    std::string const extension {".raw"};
+    return name.size() > extension.size() and
+        name.compare(name.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+
+mapped_image::mapped_image(char const * filename)
+{
+    unsigned char const * bytes = nullptr;
+    size_t length = 0;
+
+#ifdef HAVE_MMAP
+    auto const fd = ::open(filename, O_RDONLY); // NOLINT
+    if (fd < 0)
+        throw std::runtime_error(std::string {"failed to open "} + filename);
+
+    struct stat status {};
+    if (::fstat(fd, &status) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error(std::string {"failed to open "} + filename);
+    }
+
+    length = static_cast<size_t>(status.st_size);
+    if (length > 0)
+    {
+        // The mapping outlives the descriptor.
+        map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) // NOLINT
+        {
+            map = nullptr;
+            throw std::runtime_error(std::string {"failed to map "} + filename);
+        }
+        map_length = length;
+        bytes = static_cast<unsigned char const *>(map);
+    }
+    else
+        ::close(fd);
+#else
+    file_ptr const file {std::fopen(filename, "rb")};
+    if (not file)
+        throw std::runtime_error(std::string {"failed to open "} + filename);
+
+    std::array<unsigned char, 1U << 16U> buffer {};
+    size_t got = 0;
+    while ((got = std::fread(buffer.data(), 1, buffer.size(), file.get())) > 0)
+        contents.insert(contents.end(), buffer.data(), buffer.data() + got);
+
+    bytes = contents.data();
+    length = contents.size();
+#endif
+
+    try
+    {
+        std::tie(num_rows, num_cols) = parse_header(bytes, length);
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+
+    pixels = reinterpret_cast<rgb const *>(bytes + header_size); // NOLINT
+}
+
+
+mapped_image::~mapped_image()
+{
+    release();
+}
+
+
+void mapped_image::release() noexcept
+{
+#ifdef HAVE_MMAP
+    if (map != nullptr)
+        ::munmap(map, map_length);
+#endif
+    map = nullptr;
+}
+
+
+void write_raw_image(
+    size_t rows, size_t cols, char const * filename, raw_row_source const & row_at)
+{
+    file_ptr const file {std::fopen(filename, "wb")};
+    if (not file)
+        throw std::runtime_error(std::string {"failed to open "} + filename);
+
+    auto const bytes = make_header(rows, cols);
+    bool ok = std::fwrite(bytes.data(), 1, bytes.size(), file.get()) == bytes.size();
+    for (size_t row = 0; ok and row < rows; row++)
+        ok = std::fwrite(row_at(row), sizeof(rgb), cols, file.get()) == cols;
+
+    if (not ok or std::fflush(file.get()) != 0)
+        throw std::runtime_error(std::string {"failed to write "} + filename);
+}
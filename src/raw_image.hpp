@@ -0,0 +1,80 @@
+// Raw images: an uncompressed format for intermediate results.
+//
+// A raw image is a 24-byte header, followed by the packed 8-bit RGB rows of the
+// image, top to bottom: exactly the layout of `array2d<rgb>`. The header is an
+// 8-byte magic, and then the rows and columns as 64-bit little-endian integers.
+//
+// Nothing is encoded, so reading one is a memory map, and writing one is a copy.
+// That's worth it for images that are read many times, or that are only
+// written to be read back by the next step of a pipeline. They're also about
+// as big as an image can be, so PNG is still better for anything you keep.
+
+#ifndef RAW_IMAGE_HPP
+#define RAW_IMAGE_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "colors.hpp"
+
+
+// Whether the named file starts like a raw image.
+bool is_raw_image(char const * filename);
+
+// Whether an image written to this name should be raw: if it ends in ".raw".
+bool is_raw_name(char const * filename);
+
+
+// A read-only view of a raw image, mapped straight from the file where the
+// platform allows it, and read whole where it doesn't.
+class mapped_image
+{
+public:
+    explicit mapped_image(char const * filename);
+    ~mapped_image();
+
+    mapped_image(mapped_image const &) = delete;
+    mapped_image & operator=(mapped_image const &) = delete;
+
+    size_t rows() const noexcept
+    {
+        return num_rows;
+    }
+
+    size_t cols() const noexcept
+    {
+        return num_cols;
+    }
+
+    // The pixels, in row-major order.
+    rgb const * data() const noexcept
+    {
+        return pixels;
+    }
+
+    rgb const * row(size_t r) const noexcept
+    {
+        return pixels + r * num_cols;
+    }
+
+private:
+    void release() noexcept;
+
+    size_t num_rows = 0;
+    size_t num_cols = 0;
+    rgb const * pixels = nullptr;
+
+    void * map = nullptr;
+    size_t map_length = 0;
+    std::vector<unsigned char> contents;
+};
+
+
+// Write a raw image, getting each row, in order, from `row_at`.
+using raw_row_source = std::function<rgb const *(size_t row)>;
+void write_raw_image(
+    size_t rows, size_t cols, char const * filename, raw_row_source const & row_at);
+
+
+#endif
@@ -0,0 +1,121 @@
+#include "snapshot.hpp"
+
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+
+
+snapshot_writer::snapshot_writer(std::string filename, png_options png)
+    : filename {std::move(filename)}
+    , png {png}
+    , writer {&snapshot_writer::write_snapshots, this}
+{ }
+
+
+snapshot_writer::~snapshot_writer()
+{
+    {
+        std::lock_guard<std::mutex> const lock {mutex};
+        stopping = true;
+    }
+    changed.notify_all();
+    writer.join();
+}
+
+
+void snapshot_writer::offer(
+    int passes_done, size_t rows, size_t cols, filler const & fill)
+{
+    {
+        std::lock_guard<std::mutex> const lock {mutex};
+        if (waiting)
+            dropped_count++;
+
+        // The back buffer is only ever the thread's while it swaps the two.
+        if (not back or back->rows != rows or back->cols != cols)
+            back = std::make_unique<array2d<rgb>>(rows, cols);
+        fill(*back);
+        back_passes = passes_done;
+        waiting = true;
+    }
+    changed.notify_all();
+}
+
+
+void snapshot_writer::wait()
+{
+    std::unique_lock<std::mutex> lock {mutex};
+    changed.wait(lock, [&] { return not waiting and not writing; });
+    if (failure)
+        std::rethrow_exception(std::exchange(failure, nullptr));
+}
+
+
+size_t snapshot_writer::written() const
+{
+    std::lock_guard<std::mutex> const lock {mutex};
+    return written_count;
+}
+
+
+size_t snapshot_writer::dropped() const
+{
+    std::lock_guard<std::mutex> const lock {mutex};
+    return dropped_count;
+}
+
+
+void snapshot_writer::write_snapshots()
+{
+    std::unique_lock<std::mutex> lock {mutex};
+    while (true)
+    {
+        changed.wait(lock, [&] { return waiting or stopping; });
+        if (not waiting)
+            return;
+
+        std::swap(front, back);
+        auto const passes_done = back_passes;
+        waiting = false;
+        writing = true;
+        lock.unlock();
+
+        // Keep the first failure for `wait`, and carry on with the rest.
+        std::exception_ptr failed;
+        try
+        {
+            write(*front, passes_done);
+        }
+        catch (...)
+        {
+            failed = std::current_exception();
+        }
+
+        lock.lock();
+        writing = false;
+        if (failed and not failure)
+            failure = failed;
+        else if (not failed)
+            written_count++;
+        changed.notify_all();
+    }
+}
+
+
+void snapshot_writer::write(array2d<rgb> const & snapshot, int passes_done) const
+{
+    std::string const marker {"{pass}"};
+    auto const at = filename.find(marker);
+    if (at != std::string::npos)
+    {
+        auto numbered = filename;
+        numbered.replace(at, marker.size(), std::to_string(passes_done));
+        write_image(snapshot, numbered.c_str(), png);
+        return;
+    }
+
+    auto const temporary = filename + ".tmp";
+    write_image(snapshot, temporary.c_str(), png);
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("failed to replace " + filename);
+}
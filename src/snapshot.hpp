@@ -0,0 +1,83 @@
+// Writing copies of the output as it changes, without holding up the engines.
+//
+// A long run of dithering can save its output every few passes, to keep an
+// eye on its progress, but encoding an allRGB PNG takes much longer than a
+// pass. So a `snapshot_writer` keeps two buffers and a thread of its own: an
+// engine copies its output into the back buffer at the end of a pass, and the
+// thread swaps it to the front and encodes it from there. If the writer falls
+// behind, a snapshot still waiting in the back buffer is replaced by the next
+// one, and dropped. Either way, the engine only ever waits for the copy.
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "array2d.hpp"
+#include "colors.hpp"
+#include "image.hpp"
+
+
+class snapshot_writer
+{
+public:
+    // Write each snapshot to `filename`, with "{pass}" in it replaced by the
+    // number of passes done. Without "{pass}", each snapshot replaces the last
+    // whole, by writing a temporary file next to it and renaming that.
+    explicit snapshot_writer(std::string filename, png_options png = {});
+
+    // Write the snapshot waiting, if there is one, and stop the thread.
+    ~snapshot_writer();
+
+    snapshot_writer(snapshot_writer const &) = delete;
+    snapshot_writer & operator=(snapshot_writer const &) = delete;
+
+    // Fill in a snapshot of the output after `passes_done` passes, in an image
+    // of the same size, which `fill` copies the output into.
+    using filler = std::function<void(array2d<rgb> & snapshot)>;
+
+    // Take a snapshot with `fill`, to write in the background. This never
+    // waits for a write, only for the copy.
+    void offer(int passes_done, size_t rows, size_t cols, filler const & fill);
+
+    // Wait for every snapshot taken so far to be written, and throw if
+    // writing any of them failed.
+    void wait();
+
+    // The snapshots written so far, and those dropped for newer ones.
+    size_t written() const;
+    size_t dropped() const;
+
+private:
+    void write_snapshots();
+    void write(array2d<rgb> const & snapshot, int passes_done) const;
+
+    std::string filename;
+    png_options png;
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+
+    // The thread writes `front` without holding the lock; everything else is
+    // guarded by it.
+    std::unique_ptr<array2d<rgb>> front;
+    std::unique_ptr<array2d<rgb>> back;
+    int back_passes = 0;
+    bool waiting = false;
+    bool writing = false;
+    bool stopping = false;
+    size_t written_count = 0;
+    size_t dropped_count = 0;
+    std::exception_ptr failure;
+
+    // Last, so that it starts once everything above is ready.
+    std::thread writer;
+};
+
+#endif
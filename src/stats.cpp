@@ -0,0 +1,192 @@
+#include "stats.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define HAVE_PERF_EVENT 1
+#endif
+
+
+namespace {
+
+bool ends_with(std::string const & name, std::string const & extension)
+{
+    return name.size() > extension.size() and
+        name.compare(name.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+
+// Names are ours, but quote them properly anyway.
+std::string json_string(std::string const & text)
+{
+    std::string quoted {'"'};
+    for (auto const c: text)
+    {
+        if (c == '"' or c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+} // anonymous namespace
+
+
+run_stats::run_stats(bool count_cache_misses)
+{
+#ifdef HAVE_PERF_EVENT
+    if (not count_cache_misses)
+        return;
+
+    // Count for this thread and every thread it starts from now on. Threads
+    // are counted once they've finished, which the engines' all have by the
+    // end of each phase.
+    perf_event_attr attributes {};
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof attributes;
+    attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+    attributes.inherit = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    auto const fd = ::syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+    perf_fd = static_cast<int>(fd);
+#else
+    static_cast<void>(count_cache_misses);
+#endif
+}
+
+
+run_stats::~run_stats()
+{
+#ifdef HAVE_PERF_EVENT
+    if (perf_fd >= 0)
+        ::close(perf_fd);
+#endif
+}
+
+
+run_stats::scoped_timer::scoped_timer(run_stats & stats, std::string phase)
+    : stats {stats}
+    , phase {std::move(phase)}
+    , start {clock::now()}
+    , start_misses {stats.cache_misses()}
+{ }
+
+
+run_stats::scoped_timer::~scoped_timer()
+{
+    std::chrono::duration<double> const elapsed = clock::now() - start;
+    auto const misses = stats.cache_misses();
+
+    std::optional<uint64_t> phase_misses;
+    if (start_misses and misses)
+        phase_misses = *misses - *start_misses;
+
+    stats.phases.push_back({std::move(phase), elapsed.count(), phase_misses});
+}
+
+
+void run_stats::add_pass(pass_record pass)
+{
+    passes.push_back(std::move(pass));
+}
+
+
+void run_stats::add_counter(std::string name, double value)
+{
+    counters.emplace_back(std::move(name), value);
+}
+
+
+void run_stats::write(std::string const & filename) const
+{
+    std::ofstream out {filename};
+    if (not out)
+        throw std::runtime_error("failed to open " + filename);
+
+    out << std::setprecision(9);
+    if (ends_with(filename, ".csv"))
+        write_csv(out);
+    else
+        write_json(out);
+
+    if (not out.flush())
+        throw std::runtime_error("failed to write " + filename);
+}
+
+
+std::optional<uint64_t> run_stats::cache_misses() const
+{
+#ifdef HAVE_PERF_EVENT
+    uint64_t count = 0;
+    if (perf_fd >= 0 and ::read(perf_fd, &count, sizeof count) == sizeof count)
+        return count;
+#endif
+    return std::nullopt;
+}
+
+
+void run_stats::write_json(std::ostream & out) const
+{
+    out << "{\n  \"counters\": {";
+    for (size_t i = 0; i < counters.size(); i++)
+    {
+        out << (i == 0 ? "\n" : ",\n") << "    " << json_string(counters[i].first)
+            << ": " << counters[i].second;
+    }
+    out << "\n  },\n  \"phases\": [";
+
+    for (size_t i = 0; i < phases.size(); i++)
+    {
+        auto const & phase = phases[i];
+        out << (i == 0 ? "\n" : ",\n") << "    {\"name\": " << json_string(phase.name)
+            << ", \"seconds\": " << phase.seconds;
+        if (phase.cache_misses)
+            out << ", \"cache_misses\": " << *phase.cache_misses;
+        out << '}';
+    }
+    out << "\n  ],\n  \"passes\": [";
+
+    for (size_t i = 0; i < passes.size(); i++)
+    {
+        auto const & pass = passes[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"engine\": " << json_string(pass.engine)
+            << ", \"pass\": " << pass.pass << ", \"swaps\": " << pass.swaps
+            << ", \"swap_rate\": " << pass.swap_rate << ", \"rms\": " << pass.rms
+            << ", \"seconds\": " << pass.seconds
+            << ", \"shuffle_seconds\": " << pass.shuffle_seconds << '}';
+    }
+    out << "\n  ]\n}\n";
+}
+
+
+void run_stats::write_csv(std::ostream & out) const
+{
+    // One table for everything: each kind of record fills in its own columns.
+    out << "record,name,value,seconds,cache_misses,pass,swaps,swap_rate,rms,"
+           "shuffle_seconds\n";
+    for (auto const & [name, value]: counters)
+        out << "counter," << name << ',' << value << ",,,,,,,\n";
+
+    for (auto const & phase: phases)
+    {
+        out << "phase," << phase.name << ",," << phase.seconds << ',';
+        if (phase.cache_misses)
+            out << *phase.cache_misses;
+        out << ",,,,,\n";
+    }
+
+    for (auto const & pass: passes)
+    {
+        out << "pass," << pass.engine << ",," << pass.seconds << ",," << pass.pass
+            << ',' << pass.swaps << ',' << pass.swap_rate << ',' << pass.rms << ','
+            << pass.shuffle_seconds << '\n';
+    }
+}
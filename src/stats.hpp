@@ -0,0 +1,98 @@
+// Measuring where a run spends its time, for `-stats`.
+//
+// A run is split into phases, like loading the input, converting it to
+// CIELAB, each stage of swapping, and writing the output, each timed by a
+// `scoped_timer`. The swap engines also record every pass: how many pixels
+// swapped, and the error after it. Phases are listed in the order they end,
+// and can nest, like saving a checkpoint in the middle of dithering.
+//
+// Where the kernel allows it, each phase also counts hardware cache misses,
+// through perf_event on Linux. Containers and locked-down kernels often don't
+// allow it, and then the counts are left out.
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+class run_stats
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Without `count_cache_misses`, or without perf_event, phases are only
+    // timed.
+    explicit run_stats(bool count_cache_misses = true);
+    ~run_stats();
+
+    run_stats(run_stats const &) = delete;
+    run_stats & operator=(run_stats const &) = delete;
+
+    // Add the time from construction to destruction to the run, as `phase`.
+    class scoped_timer
+    {
+    public:
+        scoped_timer(run_stats & stats, std::string phase);
+        ~scoped_timer();
+
+        scoped_timer(scoped_timer const &) = delete;
+        scoped_timer & operator=(scoped_timer const &) = delete;
+
+    private:
+        run_stats & stats;
+        std::string phase;
+        clock::time_point start;
+        std::optional<uint64_t> start_misses;
+    };
+
+    // One pass of a swap engine, from its `pass_report`.
+    struct pass_record
+    {
+        std::string engine;
+        int pass;
+        size_t swaps;
+        double swap_rate;
+        double rms;
+        double seconds;
+        double shuffle_seconds;
+    };
+
+    void add_pass(pass_record pass);
+
+    // Record a fact about the whole run, like its size.
+    void add_counter(std::string name, double value);
+
+    // Write everything recorded, as CSV if `filename` ends in ".csv", and
+    // otherwise as JSON. Throw if it can't be written.
+    void write(std::string const & filename) const;
+
+private:
+    struct phase_record
+    {
+        std::string name;
+        double seconds;
+        std::optional<uint64_t> cache_misses;
+    };
+
+    // Misses so far, on this thread and the threads it started, if counted.
+    std::optional<uint64_t> cache_misses() const;
+
+    void write_json(std::ostream & out) const;
+    void write_csv(std::ostream & out) const;
+
+    std::vector<phase_record> phases;
+    std::vector<pass_record> passes;
+    std::vector<std::pair<std::string, double>> counters;
+
+    // The perf_event file descriptor, or -1 without one.
+    int perf_fd = -1;
+};
+
+#endif
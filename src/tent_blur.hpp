@@ -0,0 +1,144 @@
+// The blur that dithering compares neighborhoods with.
+//
+// For handling the edges, neither reflecting or extending seem right to me,
+// so instead, truncate the kernel at the edges. Rather than picking one of
+// many kernels by where the pixel is, the pixel state has a border of black
+// pixels, which add nothing to the sums, and the weight of the kernel inside
+// the image comes from the weights of its row and column. A uniform image
+// then blurs to itself, right up to its edges.
+
+#ifndef TENT_BLUR_HPP
+#define TENT_BLUR_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "colors.hpp"
+
+
+// A blur with a separable, tent-shaped kernel, `Radius` pixels each way: for
+// a radius of one, that's the 3x3 Gaussian
+//
+//     1  2  1
+//     2  4  2
+//     1  2  1
+//
+// and for a radius of two, each row and column weighs 1, 2, 3, 2, 1. The loops
+// run over the whole kernel, with no branches on where the pixel is.
+template <int Radius>
+class tent_blur
+{
+public:
+    static constexpr int width = 2 * Radius + 1;
+
+    static constexpr int weight(int offset)
+    {
+        return Radius + 1 - (offset < 0 ? -offset : offset);
+    }
+
+    static constexpr int center_weight = weight(0) * weight(0);
+
+    // The neighbor sums are integers, and `rgb_sum16` has to hold them.
+    static constexpr int max_total = (Radius + 1) * (Radius + 1) * (Radius + 1) *
+        (Radius + 1);
+    static_assert(
+        (max_total - center_weight) * 255 <= std::numeric_limits<int16_t>::max(),
+        "neighbor sums must fit in 16 bits");
+
+    // The pixels' state must have a border of at least `Radius`, with rows
+    // `stride` apart.
+    tent_blur(size_t rows, size_t cols, size_t stride)
+    {
+        // The weights of the kernel that fall inside the image, by row and by
+        // column.
+        auto const inside = [](size_t length) {
+            auto const end = static_cast<std::ptrdiff_t>(length);
+            std::vector<int> sums(length);
+            for (std::ptrdiff_t i = 0; i < end; i++)
+            {
+                for (int offset = -Radius; offset <= Radius; offset++)
+                {
+                    if (i + offset >= 0 and i + offset < end)
+                        sums[static_cast<size_t>(i)] += weight(offset);
+                }
+            }
+            return sums;
+        };
+        row_weights = inside(rows);
+        col_weights = inside(cols);
+
+        for (int total = 1; total <= max_total; total++)
+            inverse[static_cast<size_t>(total)] = 1.0F / static_cast<float>(total);
+
+        auto const signed_stride = static_cast<std::ptrdiff_t>(stride);
+        for (int row = 0; row < width; row++)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                auto const i = static_cast<size_t>(row * width + col);
+                offsets[i] = (row - Radius) * signed_stride + (col - Radius);
+                weights[i] =
+                    static_cast<float>(weight(row - Radius) * weight(col - Radius));
+            }
+        }
+
+        // Leave the center out of the neighborhood.
+        weights[offsets.size() / 2] = 0;
+    }
+
+    // Return the weighted sum of the neighbors of the pixel at `at`, without
+    // the pixel itself.
+    template <typename Pixels>
+    rgb_float around(Pixels const & pixels, size_t at) const
+    {
+        rgb_float sum {0, 0, 0};
+        for (size_t i = 0; i < offsets.size(); i++)
+            sum += rgb_float {pixels.output(neighbor(at, i))} * weights[i];
+        return sum;
+    }
+
+    // Using the sum of neighbors provided by `around`, fill in a center value
+    // for the pixel at `at`, which is (row, col), and get the blurred pixel.
+    template <typename Pixels>
+    rgb_float blur(
+        Pixels const & pixels,
+        size_t at,
+        size_t row,
+        size_t col,
+        rgb const & center) const
+    {
+        auto blurred = pixels.neighbors(at) + rgb_float {center} * center_weight;
+        auto const total = row_weights[row] * col_weights[col];
+        return blurred * inverse[static_cast<size_t>(total)];
+    }
+
+    // When the pixel at `at` has changed by the given `delta`, update the
+    // neighbors accordingly. The center has no weight, so it's left as it is.
+    // Neighbors in the border are updated too, but they're never read, and
+    // their sums stay within those of the image's.
+    template <typename Pixels>
+    void update(Pixels & pixels, size_t at, rgb_float const & delta) const
+    {
+        for (size_t i = 0; i < offsets.size(); i++)
+            pixels.add_to_neighbors(neighbor(at, i), delta * weights[i]);
+    }
+
+private:
+    size_t neighbor(size_t at, size_t i) const
+    {
+        return static_cast<size_t>(static_cast<std::ptrdiff_t>(at) + offsets[i]);
+    }
+
+    std::vector<int> row_weights;
+    std::vector<int> col_weights;
+    static constexpr auto area = static_cast<size_t>(width * width);
+
+    std::array<float, static_cast<size_t>(max_total + 1)> inverse {};
+    std::array<std::ptrdiff_t, area> offsets {};
+    std::array<float, area> weights {};
+};
+
+#endif
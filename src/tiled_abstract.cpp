@@ -0,0 +1,245 @@
+#include "tiled_abstract.hpp"
+
+#include <algorithm>
+#include <random>
+#include <tuple>
+
+#include "parallel.hpp"
+
+
+tiled_abstract::tiled_abstract(
+    size_t rows,
+    size_t cols,
+    size_t tile_size,
+    traversal order,
+    rng_type & rng,
+    unsigned threads)
+    : rows {rows}
+    , cols {cols}
+    , tile_size {tile_size}
+    , tile_rows {(rows + tile_size - 1) / tile_size}
+    , tile_cols {(cols + tile_size - 1) / tile_size}
+    , order {order}
+    , transform {color_transform::make_random(rng)}
+    , plan(tile_rows * tile_cols)
+{
+    // Hang each tile from a random pixel on its border with its parent tile.
+    grid_graph tiles {tile_rows, tile_cols, rng};
+    for (size_t tile = 0; tile < plan.size(); tile++)
+    {
+        auto & here = plan[tile];
+        auto const height = tile_height(tile);
+        auto const width = tile_width(tile);
+        here.seed = rng();
+        here.parent = tiles.parent(tile);
+        here.entry = 0;
+        here.port = 0;
+        here.start = 0;
+        here.total = height * width;
+        if (here.parent == tile)
+            continue;
+
+        auto const parent_width = tile_width(here.parent);
+        auto const across = [&](size_t length) {
+            return std::uniform_int_distribution<size_t> {0, length - 1}(rng);
+        };
+        size_t entry = 0;
+        size_t port = 0;
+        if (here.parent / tile_cols == tile / tile_cols)
+        {
+            // Side by side, in the same band.
+            auto const row = across(height);
+            auto const left = here.parent < tile;
+            entry = row * width + (left ? 0 : width - 1);
+            port = row * parent_width + (left ? parent_width - 1 : 0);
+        }
+        else
+        {
+            // One above the other, in the same column of tiles.
+            auto const col = across(width);
+            auto const above = here.parent < tile;
+            entry = (above ? 0 : (height - 1) * width) + col;
+            port = (above ? (tile_height(here.parent) - 1) * width : 0) + col;
+        }
+        here.entry = static_cast<pixel_index>(entry);
+        here.port = static_cast<pixel_index>(port);
+    }
+
+    // Count the colors that each tile and the tiles below it take, from the
+    // leaves up.
+    auto const by_depth = tiles.bfs();
+    for (auto k = by_depth.size(); k-- > 1; )
+    {
+        auto const & here = plan[by_depth[k]];
+        plan[here.parent].total += here.total;
+    }
+
+    // Each tile's colors start where its parent tile puts them, so lay them
+    // out one level of the tree over tiles at a time.
+    std::vector<size_t> depth(plan.size(), 0);
+    for (size_t k = 1; k < by_depth.size(); k++)
+        depth[by_depth[k]] = depth[plan[by_depth[k]].parent] + 1;
+
+    for (size_t level = 0; level < by_depth.size(); )
+    {
+        auto next_level = level;
+        while (next_level < by_depth.size()
+               and depth[by_depth[next_level]] == depth[by_depth[level]])
+            next_level++;
+
+        parallel_for(
+            threads, next_level - level, [&](unsigned, size_t begin, size_t end) {
+                std::vector<run_t> runs;
+                std::vector<std::pair<size_t, size_t>> hung;
+                for (auto k = level + begin; k < level + end; k++)
+                {
+                    lay_out(by_depth[k], runs, hung);
+                    for (auto const & [child, start]: hung)
+                        plan[child].start = start;
+                }
+            });
+        level = next_level;
+    }
+}
+
+
+size_t tiled_abstract::num_bands() const noexcept
+{
+    return tile_rows;
+}
+
+
+size_t tiled_abstract::band_rows(size_t band) const noexcept
+{
+    return std::min(tile_size, rows - band * tile_size);
+}
+
+
+size_t tiled_abstract::tile_height(size_t tile) const noexcept
+{
+    return band_rows(tile / tile_cols);
+}
+
+
+size_t tiled_abstract::tile_width(size_t tile) const noexcept
+{
+    return std::min(tile_size, cols - tile % tile_cols * tile_size);
+}
+
+
+std::vector<pixel_index> tiled_abstract::lay_out(
+    size_t tile,
+    std::vector<run_t> & runs,
+    std::vector<std::pair<size_t, size_t>> & hung) const
+{
+    auto const & here = plan[tile];
+    rng_type rng {here.seed};
+    grid_graph graph {tile_height(tile), tile_width(tile), rng};
+    if (here.parent != tile)
+        graph.set_root(here.entry);
+
+    auto const pixels = (order == traversal::sdfs) ? graph.sdfs()
+        : (order == traversal::dfs)                ? graph.dfs()
+                                                   : graph.bfs();
+
+    // The child tiles, if any, are next to this one. Each takes its colors
+    // after those of the subtree of its port, as its port's last child, or
+    // after this whole tile in breadth-first order.
+    struct hook_t
+    {
+        size_t end;
+        size_t position;
+        size_t tile;
+    };
+    std::vector<hook_t> hooks;
+    std::vector<pixel_index> positions;
+    std::vector<pixel_index> sizes;
+    auto const hang = [&](size_t next) {
+        if (plan[next].parent != tile)
+            return;
+
+        auto const port = plan[next].port;
+        if (order == traversal::bfs)
+        {
+            hooks.push_back({pixels.size(), 0, next});
+            return;
+        }
+
+        if (positions.empty())
+        {
+            positions.resize(pixels.size());
+            sizes.assign(pixels.size(), 1);
+            for (size_t k = 0; k < pixels.size(); k++)
+                positions[pixels[k]] = static_cast<pixel_index>(k);
+            for (auto k = pixels.size(); k-- > 1; )
+                sizes[graph.parent(pixels[k])] += sizes[pixels[k]];
+        }
+        auto const position = size_t {positions[port]};
+        hooks.push_back({position + sizes[port], position, next});
+    };
+
+    auto const col = tile % tile_cols;
+    if (tile >= tile_cols)
+        hang(tile - tile_cols);
+    if (col + 1 < tile_cols)
+        hang(tile + 1);
+    if (tile + tile_cols < plan.size())
+        hang(tile + tile_cols);
+    if (col > 0)
+        hang(tile - 1);
+
+    // Where subtrees end together, the deeper one's child tile comes first.
+    std::sort(hooks.begin(), hooks.end(), [](auto const & a, auto const & b) {
+        return std::tie(a.end, b.position, a.tile)
+            < std::tie(b.end, a.position, b.tile);
+    });
+
+    runs.clear();
+    hung.clear();
+    size_t done = 0;
+    auto start = here.start;
+    for (auto const & hook: hooks)
+    {
+        if (hook.end > done)
+        {
+            runs.push_back({done, hook.end, start});
+            start += hook.end - done;
+            done = hook.end;
+        }
+        hung.emplace_back(hook.tile, start);
+        start += plan[hook.tile].total;
+    }
+    if (done < pixels.size())
+        runs.push_back({done, pixels.size(), start});
+
+    return pixels;
+}
+
+
+void tiled_abstract::render_band(
+    size_t band, array2d<rgb> & pixels, unsigned threads) const
+{
+    parallel_for(threads, tile_cols, [&](unsigned, size_t begin, size_t end) {
+        std::vector<run_t> runs;
+        std::vector<std::pair<size_t, size_t>> hung;
+        for (auto tile_col = begin; tile_col < end; tile_col++)
+        {
+            auto const tile = band * tile_cols + tile_col;
+            auto const left = tile_col * tile_size;
+            auto const width = tile_width(tile);
+            auto const visited = lay_out(tile, runs, hung);
+
+            for (auto const & run: runs)
+            {
+                auto const palette = make_hilbert_palette_slice(
+                    rows * cols, run.start, run.start + run.end - run.begin);
+                for (auto k = run.begin; k < run.end; k++)
+                {
+                    auto const idx = visited[k];
+                    pixels(idx / width, left + idx % width) =
+                        transform(palette[k - run.begin]);
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,106 @@
+// Generating abstract images too large to hold in memory, one tile at a time.
+//
+// The whole-image generator in main_abstract.cpp keeps a spanning tree, the
+// palette, and the output image in memory at once. Here, the image is cut into
+// square tiles instead, each with a random spanning tree of its own pixels.
+// A random spanning tree over the tiles stitches those together: each tile
+// hangs from a random pixel on its border with its parent tile, and its own
+// tree is rooted at the pixel across from it. That makes one spanning tree of
+// the whole image, though not a uniformly random one, since it only crosses
+// from tile to tile once along each edge of the tree over tiles.
+//
+// The pixels take the Hilbert-ordered palette in the order of that one tree.
+// In a depth-first order, a tile's colors carry on from the pixel it hangs
+// from, after that pixel's subtree within the parent tile, just as they would
+// for any other child. In breadth-first order, tiles are only searched one at
+// a time, so a tile's colors follow all of its parent tile's.
+//
+// To know where each tile's colors start, the plan builds every tile's tree
+// once up front, and rendering builds it again. Each row of tiles renders on
+// its own, so memory grows with the width of the image, the size of a tile,
+// and the number of tiles, not with the area of the image.
+
+#ifndef TILED_ABSTRACT_HPP
+#define TILED_ABSTRACT_HPP
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "array2d.hpp"
+#include "colors.hpp"
+#include "grid.hpp"
+
+
+class tiled_abstract
+{
+public:
+    using rng_type = grid_graph::rng_type;
+
+    // Plan a `rows` by `cols` image in tiles of `tile_size` on a side, visiting
+    // pixels and tiles in the given order, on up to `threads` threads. The
+    // plan depends only on the state of `rng`, not on the number of threads.
+    tiled_abstract(
+        size_t rows,
+        size_t cols,
+        size_t tile_size,
+        traversal order,
+        rng_type & rng,
+        unsigned threads = 1);
+
+    // The image is rendered in bands, each one row of tiles high.
+    size_t num_bands() const noexcept;
+    size_t band_rows(size_t band) const noexcept;
+
+    // Render a band into `pixels`, which must be `band_rows(band)` by `cols`,
+    // using up to `threads` threads. Bands may be rendered in any order.
+    void render_band(size_t band, array2d<rgb> & pixels, unsigned threads) const;
+
+private:
+    size_t const rows;
+    size_t const cols;
+    size_t const tile_size;
+    size_t const tile_rows;
+    size_t const tile_cols;
+    traversal const order;
+    color_transform const transform;
+
+    // Each tile but the root one hangs from its `port`, a pixel of its parent
+    // tile, next to its `entry`, the root of its own tree. Both are indices
+    // into the pixels of their tiles, in row-major order.
+    struct tile_t
+    {
+        uint64_t seed;
+        size_t parent;
+        pixel_index entry;
+        pixel_index port;
+
+        // Where the tile's colors start in the palette, and how many colors
+        // it and the tiles below it take.
+        size_t start;
+        size_t total;
+    };
+    std::vector<tile_t> plan;
+
+    size_t tile_height(size_t tile) const noexcept;
+    size_t tile_width(size_t tile) const noexcept;
+
+    // A stretch of a tile's pixels, [begin, end) in the order they're visited,
+    // whose colors are next to each other in the palette from `start` on.
+    struct run_t
+    {
+        size_t begin;
+        size_t end;
+        size_t start;
+    };
+
+    // Build the tree of a tile, once `start` is known for it, and find the
+    // order to visit its pixels in, the runs of colors they take, and where
+    // the colors of each of its child tiles start, in `hung`.
+    std::vector<pixel_index> lay_out(
+        size_t tile,
+        std::vector<run_t> & runs,
+        std::vector<std::pair<size_t, size_t>> & hung) const;
+};
+
+#endif
@@ -3,11 +3,39 @@
 #include <algorithm>
 #include <bitset>
 #include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "array2d.hpp"
+#include "batch.hpp"
+#include "checkpoint.hpp"
 #include "colors.hpp"
 #include "grid.hpp"
 #include "hilbert.hpp"
+#include "image.hpp"
+#include "pairing.hpp"
+#include "palette_cache.hpp"
+#include "permutations.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
+#include "pixel_layout.hpp"
+#include "raw_image.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "tent_blur.hpp"
+#include "tiled_abstract.hpp"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 
 TEST_CASE("make_palette makes all colors")
@@ -48,6 +76,39 @@ TEST_CASE("make_palette evenly subsamples")
 }
 
 
+TEST_CASE("batch Hilbert functions match the scalar ones")
+{
+    std::vector<unsigned> indices(rgb::num_colors);
+    std::iota(indices.begin(), indices.end(), 0);
+
+    std::vector<rgb> colors(indices.size());
+    hilbert_decode(indices.data(), indices.size(), colors.data());
+
+    std::vector<unsigned> encoded(colors.size());
+    hilbert_encode(colors.data(), colors.size(), encoded.data());
+
+    bool matches = true;
+    for (unsigned i = 0; i < rgb::num_colors; i++)
+        matches = matches and colors[i] == hilbert_decode(i) and
+            encoded[i] == hilbert_encode(colors[i]) and encoded[i] == i;
+    REQUIRE(matches);
+}
+
+
+TEST_CASE("make_hilbert_palette is sorted")
+{
+    auto const full = make_hilbert_palette(rgb::num_colors, 3);
+    bool in_order = true;
+    for (size_t i = 0; i < full.size(); i++)
+        in_order = in_order and (hilbert_encode(full[i]) == i);
+    REQUIRE(in_order);
+
+    auto const sampled = make_palette(10'000);
+    REQUIRE(std::is_sorted(sampled.begin(), sampled.end(), hilbert_compare));
+    REQUIRE(make_hilbert_palette(sampled.size(), 3) == sampled);
+}
+
+
 TEST_CASE("has_all_colors works")
 {
     auto palette = make_palette(rgb::num_colors);
@@ -79,3 +140,1128 @@ TEST_CASE("grid_graph produces a spanning tree")
     }
     REQUIRE(visited.all());
 }
+
+
+TEST_CASE("grid_graph traversals visit every node once")
+{
+    grid_graph::rng_type rng {3};
+    grid_graph g {120, 90, rng};
+
+    for (auto order: {g.sdfs(), g.bfs()})
+    {
+        REQUIRE(order.front() == g.dfs().front());
+        std::sort(order.begin(), order.end());
+
+        std::vector<pixel_index> all(120 * 90);
+        std::iota(all.begin(), all.end(), pixel_index {0});
+        REQUIRE(order == all);
+    }
+}
+
+
+TEST_CASE("grid_graph traversals visit nodes in order")
+{
+    constexpr size_t rows = 70;
+    constexpr size_t cols = 50;
+    grid_graph::rng_type rng {4};
+    grid_graph const g {rows, cols, rng};
+
+    // Rebuild the tree from the parents of the nodes, with each node's
+    // children towards left, down, right, and up.
+    std::vector<std::vector<size_t>> kids(rows * cols);
+    size_t root = 0;
+    for (size_t i = 0; i < rows * cols; i++)
+    {
+        if (g.parent(i) == i)
+            root = i;
+        else
+            kids[g.parent(i)].push_back(i);
+    }
+
+    auto const rank = [](size_t parent, size_t kid) {
+        if (kid + 1 == parent)
+            return 0;
+        if (kid == parent + cols)
+            return 1;
+        return (kid == parent + 1) ? 2 : 3;
+    };
+    for (size_t i = 0; i < kids.size(); i++)
+    {
+        std::sort(kids[i].begin(), kids[i].end(), [&](size_t lhs, size_t rhs) {
+            return rank(i, lhs) < rank(i, rhs);
+        });
+    }
+
+    auto const preorder = [&](std::vector<std::vector<size_t>> const & tree) {
+        std::vector<pixel_index> order;
+        std::vector<size_t> stack {root};
+        while (not stack.empty())
+        {
+            auto const idx = stack.back();
+            stack.pop_back();
+            order.push_back(static_cast<pixel_index>(idx));
+            stack.insert(stack.end(), tree[idx].rbegin(), tree[idx].rend());
+        }
+        return order;
+    };
+    auto const dfs = preorder(kids);
+    REQUIRE(g.dfs() == dfs);
+
+    // Children of shorter subtrees first, and in `dfs` order among equals.
+    std::vector<unsigned> heights(rows * cols);
+    for (auto i = dfs.rbegin(); i != dfs.rend(); i++)
+    {
+        for (auto const kid: kids[*i])
+            heights[*i] = std::max(heights[*i], heights[kid] + 1);
+    }
+    auto shortest = kids;
+    for (auto & children: shortest)
+    {
+        std::stable_sort(children.begin(), children.end(), [&](size_t lhs, size_t rhs) {
+            return heights[lhs] < heights[rhs];
+        });
+    }
+    REQUIRE(g.sdfs() == preorder(shortest));
+
+    // Level by level, with each node's children towards up, right, down, and
+    // left.
+    std::vector<pixel_index> bfs;
+    std::vector<size_t> level {root};
+    while (not level.empty())
+    {
+        std::vector<size_t> next;
+        for (auto const idx: level)
+        {
+            bfs.push_back(static_cast<pixel_index>(idx));
+            next.insert(next.end(), kids[idx].rbegin(), kids[idx].rend());
+        }
+        level = std::move(next);
+    }
+    REQUIRE(g.bfs() == bfs);
+
+    std::vector<pixel_index> visited;
+    g.visit(traversal::sdfs, [&](size_t idx) {
+        visited.push_back(static_cast<pixel_index>(idx));
+    });
+    REQUIRE(visited == g.sdfs());
+}
+
+
+TEST_CASE("grid_graph set_root keeps the same tree")
+{
+    grid_graph::rng_type rng {4};
+    grid_graph g {70, 50, rng};
+
+    auto const edges = [&] {
+        std::vector<std::pair<size_t, size_t>> pairs;
+        for (size_t i = 0; i < 70 * 50; i++)
+        {
+            if (g.parent(i) != i)
+                pairs.emplace_back(std::minmax(i, g.parent(i)));
+        }
+        std::sort(pairs.begin(), pairs.end());
+        return pairs;
+    };
+    auto const before = edges();
+
+    for (size_t const root: {size_t {0}, size_t {1234}, size_t {70 * 50 - 1}})
+    {
+        g.set_root(root);
+        REQUIRE(g.parent(root) == root);
+        REQUIRE(g.dfs().front() == root);
+        REQUIRE(edges() == before);
+    }
+}
+
+
+TEST_CASE("grid_graph is independent of thread count")
+{
+    grid_graph::rng_type serial_rng {5};
+    grid_graph serial {300, 200, serial_rng};
+
+    grid_graph::rng_type threaded_rng {5};
+    grid_graph threaded {300, 200, threaded_rng, 3};
+
+    REQUIRE(serial.dfs() == threaded.dfs());
+    REQUIRE(serial_rng == threaded_rng);
+}
+
+
+TEST_CASE("tiled_abstract uses each palette color once, along one tree")
+{
+    constexpr size_t rows = 70;
+    constexpr size_t cols = 50;
+
+    // The palette positions of the colors, to follow the image's tree by.
+    auto const palette = make_hilbert_palette(rows * cols);
+
+    for (auto const order: {traversal::sdfs, traversal::dfs, traversal::bfs})
+    {
+        grid_graph::rng_type rng {4};
+        auto transform_rng = rng;
+        auto const transform = color_transform::make_random(transform_rng);
+        std::unordered_map<unsigned, size_t> positions;
+        for (size_t i = 0; i < palette.size(); i++)
+            positions[unsigned(transform(palette[i]))] = i;
+
+        auto threaded_rng = rng;
+        tiled_abstract const tiles {rows, cols, 16, order, rng};
+        tiled_abstract const threaded_tiles {rows, cols, 16, order, threaded_rng, 3};
+        REQUIRE(tiles.num_bands() == 5);
+
+        array2d<size_t> position(rows, cols);
+        size_t band_begin = 0;
+        for (size_t band = 0; band < tiles.num_bands(); band++)
+        {
+            array2d<rgb> serial(tiles.band_rows(band), cols);
+            tiles.render_band(band, serial, 1);
+            array2d<rgb> threaded(tiles.band_rows(band), cols);
+            threaded_tiles.render_band(band, threaded, 3);
+            REQUIRE(serial.data == threaded.data);
+
+            for (size_t row = 0; row < serial.rows; row++)
+            {
+                for (size_t col = 0; col < cols; col++)
+                {
+                    auto const at = positions.find(unsigned(serial(row, col)));
+                    REQUIRE(at != positions.end());
+                    position(band_begin + row, col) = at->second;
+                }
+            }
+            band_begin += serial.rows;
+        }
+
+        // Every color once, so every position once.
+        auto sorted = position.data;
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<size_t> all(rows * cols);
+        std::iota(all.begin(), all.end(), size_t {0});
+        REQUIRE(sorted == all);
+
+        // The colors follow one tree across the tiles; so all but the first
+        // pixel are next to their parent, which came before them.
+        size_t unreached = 0;
+        for (size_t row = 0; row < rows; row++)
+        {
+            for (size_t col = 0; col < cols; col++)
+            {
+                auto const here = position(row, col);
+                auto const earlier = [&](size_t r, size_t c) {
+                    return position(r, c) < here;
+                };
+                bool const reached = (row > 0 and earlier(row - 1, col))
+                    or (row + 1 < rows and earlier(row + 1, col))
+                    or (col > 0 and earlier(row, col - 1))
+                    or (col + 1 < cols and earlier(row, col + 1));
+                unreached += (here > 0 and not reached) ? 1 : 0;
+            }
+        }
+        REQUIRE(unreached == 0);
+    }
+}
+
+
+TEST_CASE("lab_table matches direct conversion")
+{
+    auto const & table = lab_table::instance();
+    REQUIRE(lab_table::is_built());
+
+    bool matches = true;
+    for (unsigned i = 0; i < rgb::num_colors; i++)
+    {
+        auto const direct = lab {rgb {i}};
+        auto const & lookup = table[rgb {i}];
+        matches = matches and direct.L == lookup.L and direct.a == lookup.a and
+            direct.b == lookup.b;
+    }
+    REQUIRE(matches);
+}
+
+
+TEST_CASE("lab16 rounds to within its resolution")
+{
+    // Each channel is off by at most half a step.
+    float const tolerance = 3 * std::pow(0.5F / lab16::scale, 2.0F);
+
+    bool close = true;
+    for (auto const & color: make_palette(10'000))
+    {
+        auto const exact = lab {color};
+        lab const rounded = lab16 {exact};
+        close = close and diff2(exact, rounded) <= tolerance;
+    }
+    REQUIRE(close);
+}
+
+
+TEST_CASE("fast_lab is within its tolerance of direct conversion")
+{
+    // Blurred colors take any value in range, including the ends.
+    permute_rng_type rng {1};
+    std::uniform_real_distribution<float> channel {0.0F, 255.0F};
+    std::vector<rgb_float> colors {{0, 0, 0}, {255, 255, 255}, {1, 0, 0}, {0, 0, 254}};
+    for (int i = 0; i < 100'000; i++)
+        colors.emplace_back(channel(rng), channel(rng), channel(rng));
+
+    float worst = 0;
+    for (size_t i = 0; i < colors.size(); i += 4)
+    {
+        auto const fast =
+            fast_lab({colors[i], colors[i + 1], colors[i + 2], colors[i + 3]});
+        for (size_t j = 0; j < 4; j++)
+        {
+            auto const exact = lab {colors[i + j]};
+            worst = std::max({
+                worst,
+                std::abs(exact.L - fast[j].L),
+                std::abs(exact.a - fast[j].a),
+                std::abs(exact.b - fast[j].b)});
+        }
+    }
+    REQUIRE(worst <= fast_lab_tolerance);
+}
+
+
+namespace {
+
+// A directory of a test's own for the files it writes, which goes away with
+// everything in it at the end of the test.
+class scratch_directory
+{
+public:
+    explicit scratch_directory(std::string const & name)
+        : path {std::filesystem::temp_directory_path()
+                / ("allrgb-" + name + "-" + std::to_string(std::random_device {}()))}
+    {
+        std::filesystem::create_directories(path);
+    }
+
+    ~scratch_directory()
+    {
+        std::error_code error;
+        std::filesystem::remove_all(path, error);
+    }
+
+    scratch_directory(scratch_directory const &) = delete;
+    scratch_directory & operator=(scratch_directory const &) = delete;
+
+    // The name of a file in the directory.
+    std::string operator/(std::string const & file) const
+    {
+        return (path / file).string();
+    }
+
+    std::string name() const
+    {
+        return path.string();
+    }
+
+private:
+    std::filesystem::path const path;
+};
+
+
+// An image of random colors, which makes a demanding input.
+array2d<rgb> random_image(size_t rows, size_t cols, permute_rng_type & rng)
+{
+    array2d<rgb> image(rows, cols);
+    for (auto & pixel: image.data)
+        pixel = rgb {static_cast<unsigned>(rng() % rgb::num_colors)};
+
+    return image;
+}
+
+
+// A shuffled palette image, as `permute` starts with.
+array2d<rgb> shuffled_palette(size_t rows, size_t cols, permute_rng_type & rng)
+{
+    array2d<rgb> image(rows, cols);
+    image.data = make_palette(rows * cols);
+    std::shuffle(image.data.begin(), image.data.end(), rng);
+    return image;
+}
+
+
+// Return true if the images have the same colors, in any order.
+bool same_colors(array2d<rgb> lhs, array2d<rgb> rhs)
+{
+    auto by_value = [](rgb l, rgb r) { return unsigned(l) < unsigned(r); };
+    std::sort(lhs.data.begin(), lhs.data.end(), by_value);
+    std::sort(rhs.data.begin(), rhs.data.end(), by_value);
+    return lhs.data == rhs.data;
+}
+
+} // anonymous namespace
+
+
+TEST_CASE("match_ascending orders by lightness")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(60, 40, rng);
+    auto const palette = shuffled_palette(60, 40, rng);
+
+    auto serial = palette;
+    match_ascending(input, serial);
+    auto threaded = palette;
+    match_ascending(input, threaded, 3);
+    REQUIRE(serial.data == threaded.data);
+    REQUIRE(same_colors(serial, palette));
+
+    // Lightness is sorted to a resolution of 100 / 2^16, so pixels that differ
+    // by more than that in the input keep their order in the output.
+    std::vector<size_t> order(input.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](auto lhs, auto rhs) {
+        return lab {input[lhs]}.L < lab {input[rhs]}.L;
+    });
+
+    bool ascending = true;
+    for (size_t i = 0; i + 1 < order.size(); i++)
+    {
+        auto const input_step =
+            lab {input[order[i + 1]]}.L - lab {input[order[i]]}.L;
+        auto const step = lab {serial[order[i + 1]]}.L - lab {serial[order[i]]}.L;
+        ascending = ascending and (input_step < 0.002F or step > -0.002F);
+    }
+    REQUIRE(ascending);
+}
+
+
+TEST_CASE("compare_and_swap is independent of thread count")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(64, 48, rng);
+    auto const palette = shuffled_palette(64, 48, rng);
+
+    for (auto const pairs: {pairing::shuffled, pairing::blocked, pairing::streamed})
+    {
+        swap_options options;
+        options.pairs = pairs;
+        options.block_size = 16;
+
+        auto serial = palette;
+        permute_rng_type serial_rng {2};
+        compare_and_swap(input, serial, 5, serial_rng, options);
+
+        auto threaded = palette;
+        permute_rng_type threaded_rng {2};
+        options.threads = 4;
+        compare_and_swap(input, threaded, 5, threaded_rng, options);
+
+        REQUIRE(serial.data == threaded.data);
+        REQUIRE(same_colors(threaded, palette));
+        REQUIRE(threaded.data != palette.data);
+    }
+}
+
+
+TEST_CASE("compare_and_swap_coarse moves colors toward the input")
+{
+    // A smooth input, with partial blocks on the bottom and right edges.
+    array2d<rgb> input(67, 45);
+    for (size_t row = 0; row < input.rows; row++)
+        for (size_t col = 0; col < input.cols; col++)
+            input(row, col) = rgb {static_cast<unsigned>(
+                ((row * 255 / input.rows) << 16U) | ((col * 255 / input.cols) << 8U))};
+
+    permute_rng_type rng {1};
+    auto const palette = shuffled_palette(67, 45, rng);
+
+    auto serial = palette;
+    permute_rng_type serial_rng {2};
+    compare_and_swap_coarse(input, serial, 20, serial_rng);
+
+    auto threaded = palette;
+    permute_rng_type threaded_rng {2};
+    swap_options options;
+    options.threads = 3;
+    compare_and_swap_coarse(input, threaded, 20, threaded_rng, options);
+
+    REQUIRE(serial.data == threaded.data);
+    REQUIRE(same_colors(serial, palette));
+
+    auto const total_error = [&](array2d<rgb> const & output) {
+        double total = 0;
+        for (size_t i = 0; i < output.size(); i++)
+            total += static_cast<double>(diff2(lab {output[i]}, lab {input[i]}));
+        return total;
+    };
+    // It gets closer than a pass of `compare_and_swap`, for less work.
+    auto swapped = palette;
+    permute_rng_type swapped_rng {2};
+    compare_and_swap(input, swapped, 1, swapped_rng);
+    REQUIRE(total_error(serial) < total_error(swapped));
+}
+
+
+TEST_CASE("blocked dithering is independent of thread count")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(70, 50, rng);
+    auto const palette = shuffled_palette(70, 50, rng);
+
+    swap_options options;
+    options.pairs = pairing::blocked;
+    options.block_size = 16;
+
+    auto serial = palette;
+    permute_rng_type serial_rng {2};
+    compare_and_swap_dithered(input, serial, 3, serial_rng, options);
+
+    auto threaded = palette;
+    permute_rng_type threaded_rng {2};
+    options.threads = 3;
+    compare_and_swap_dithered(input, threaded, 3, threaded_rng, options);
+
+    REQUIRE(serial.data == threaded.data);
+    REQUIRE(same_colors(threaded, palette));
+    REQUIRE(threaded.data != palette.data);
+}
+
+
+TEST_CASE("dithering with the 5x5 blur is independent of thread count")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(70, 50, rng);
+    auto const palette = shuffled_palette(70, 50, rng);
+
+    swap_options options;
+    options.pairs = pairing::blocked;
+    options.block_size = 16;
+
+    auto narrow = palette;
+    permute_rng_type narrow_rng {2};
+    compare_and_swap_dithered(input, narrow, 3, narrow_rng, options);
+
+    options.dither_radius = 2;
+    auto serial = palette;
+    permute_rng_type serial_rng {2};
+    compare_and_swap_dithered(input, serial, 3, serial_rng, options);
+
+    auto threaded = palette;
+    permute_rng_type threaded_rng {2};
+    options.threads = 3;
+    compare_and_swap_dithered(input, threaded, 3, threaded_rng, options);
+
+    REQUIRE(serial.data == threaded.data);
+    REQUIRE(same_colors(threaded, palette));
+    REQUIRE(threaded.data != narrow.data);
+
+    options.dither_radius = 3;
+    REQUIRE_THROWS_AS(
+        compare_and_swap_dithered(input, threaded, 1, threaded_rng, options),
+        std::runtime_error);
+}
+
+
+TEST_CASE("tent_blur leaves a uniform image as it is, up to its edges")
+{
+    // Every pixel here is within two of an edge, except in the largest.
+    rgb const color {0xC85A1EU};
+    for (auto const & [rows, cols]:
+         {std::pair<size_t, size_t> {1, 1}, {2, 5}, {4, 3}, {7, 9}})
+    {
+        array2d<rgb> output(rows, cols);
+        std::fill(output.data.begin(), output.data.end(), color);
+        array2d<lab> input_lab(rows, cols);
+
+        dither_pixels<default_pixel_layout> pixels {output, input_lab, 2};
+        tent_blur<2> const blur {output.rows, output.cols, pixels.stride()};
+        for (size_t i = 0; i < output.size(); i++)
+        {
+            auto const at = pixels.position(i);
+            pixels.add_to_neighbors(at, blur.around(pixels, at));
+        }
+
+        for (size_t row = 0; row < output.rows; row++)
+        {
+            for (size_t col = 0; col < output.cols; col++)
+            {
+                auto const at = pixels.position(row, col);
+                auto const blurred = blur.blur(pixels, at, row, col, color);
+                REQUIRE(blurred.r == Approx(color.r));
+                REQUIRE(blurred.g == Approx(color.g));
+                REQUIRE(blurred.b == Approx(color.b));
+            }
+        }
+    }
+}
+
+
+TEST_CASE("fill_rows fills untouched arrays in parallel")
+{
+    auto const check = [](unsigned threads) {
+        padded_array2d<int, first_touch_allocator<int>> array(7, 5, 2);
+        std::fill(array.data.begin(), array.data.end(), -1);
+        fill_rows(array, threads, [](size_t i) { return static_cast<int>(i) + 1; });
+
+        std::vector<int, first_touch_allocator<int>> expected(array.data.size(), 0);
+        for (size_t i = 0; i < 7 * 5; i++)
+            expected[array.index(i)] = static_cast<int>(i) + 1;
+        REQUIRE(array.data == expected);
+    };
+
+    for (unsigned threads: {1U, 3U, 7U, 9U})
+        check(threads);
+
+    // Pinning moves threads, but doesn't change what they do, and the calling
+    // thread goes back to where it could run before.
+#ifdef __linux__
+    cpu_set_t before;
+    CPU_ZERO(&before);
+    REQUIRE(sched_getaffinity(0, sizeof before, &before) == 0);
+#endif
+    set_thread_pinning(true);
+    check(3);
+    set_thread_pinning(false);
+#ifdef __linux__
+    cpu_set_t after;
+    CPU_ZERO(&after);
+    REQUIRE(sched_getaffinity(0, sizeof after, &after) == 0);
+    REQUIRE(CPU_EQUAL(&before, &after));
+#endif
+}
+
+
+TEST_CASE("check_pixel_index names the width of the indices")
+{
+    constexpr auto bits = std::numeric_limits<pixel_index>::digits;
+    check_pixel_index(0);
+    check_pixel_index(size_t {std::numeric_limits<pixel_index>::max()});
+    if constexpr (bits < std::numeric_limits<size_t>::digits)
+    {
+        auto const too_many = (size_t {1} << bits) + 1;
+        REQUIRE_THROWS_WITH(
+            check_pixel_index(too_many),
+            Catch::Contains(std::to_string(bits) + "-bit pixel indices"));
+    }
+}
+
+
+TEST_CASE("random_permutation is a permutation")
+{
+    random_permutation::rng_type rng {3};
+    for (size_t size: {1U, 2U, 5U, 1000U, 4097U})
+    {
+        random_permutation permutation {size, rng};
+
+        std::vector<bool> seen(size);
+        for (size_t i = 0; i < size; i++)
+            seen[permutation(i)] = true;
+
+        REQUIRE(std::all_of(seen.begin(), seen.end(), [](bool b) { return b; }));
+    }
+}
+
+
+TEST_CASE("shuffle_indices is a permutation independent of thread count")
+{
+    // Sizes for one bucket, and for several uneven ones.
+    for (size_t size: {0U, 1U, 1000U, 200'000U})
+    {
+        std::vector<pixel_index> serial(size);
+        std::iota(serial.begin(), serial.end(), 0);
+        auto threaded = serial;
+        shuffle_scratch scratch;
+
+        random_permutation::rng_type serial_rng {7};
+        shuffle_indices(serial, scratch, serial_rng);
+        random_permutation::rng_type threaded_rng {7};
+        shuffle_indices(threaded, scratch, threaded_rng, 3);
+
+        REQUIRE(serial == threaded);
+        REQUIRE(serial_rng == threaded_rng);
+
+        // A random permutation has about one fixed point.
+        size_t unmoved = 0;
+        for (size_t i = 0; i < size; i++)
+            unmoved += (serial[i] == i) ? 1U : 0U;
+        REQUIRE(unmoved < 10);
+
+        std::sort(serial.begin(), serial.end());
+        std::vector<pixel_index> all(size);
+        std::iota(all.begin(), all.end(), pixel_index {0});
+        REQUIRE(serial == all);
+    }
+}
+
+
+TEST_CASE("swap engines stop early")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(40, 30, rng);
+    auto const palette = shuffled_palette(40, 30, rng);
+
+    // A deadline that has already passed stops after the first pass.
+    swap_options expired;
+    expired.deadline = std::chrono::steady_clock::now();
+
+    auto one_pass = palette;
+    permute_rng_type one_pass_rng {2};
+    compare_and_swap(input, one_pass, 1, one_pass_rng);
+
+    auto stopped = palette;
+    permute_rng_type stopped_rng {2};
+    compare_and_swap(input, stopped, 100, stopped_rng, expired);
+    REQUIRE(stopped.data == one_pass.data);
+
+    // Every pass swaps less than all of the pixels.
+    swap_options converged;
+    converged.min_swap_rate = 1.0;
+
+    auto one_dither = palette;
+    permute_rng_type one_dither_rng {2};
+    compare_and_swap_dithered(input, one_dither, 1, one_dither_rng);
+
+    auto converged_dither = palette;
+    permute_rng_type converged_rng {2};
+    compare_and_swap_dithered(input, converged_dither, 100, converged_rng, converged);
+    REQUIRE(converged_dither.data == one_dither.data);
+}
+
+
+TEST_CASE("dithering runs every pass by default, even as the error rises")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(40, 30, rng);
+    auto output = shuffled_palette(40, 30, rng);
+    compare_and_swap(input, output, 20, rng);
+
+    error_tracker swapped {output.size()};
+    for (size_t i = 0; i < output.size(); i++)
+        swapped.add_pixel(diff2(lab {output[i]}, lab {input[i]}));
+
+    // Dithering trades per-pixel error for a better blurred match, so right
+    // after swapping, it raises the RMS error that passes report.
+    std::vector<pass_report> reports;
+    swap_options options;
+    options.progress = [&](pass_report const & report) { reports.push_back(report); };
+    compare_and_swap_dithered(input, output, 3, rng, options);
+
+    REQUIRE(reports.front().rms() > swapped.report().rms());
+    REQUIRE(reports.size() == 3);
+}
+
+
+TEST_CASE("error_tracker matches a fresh sum")
+{
+    permute_rng_type rng {1};
+    auto const input = random_image(40, 30, rng);
+    auto output = shuffled_palette(40, 30, rng);
+
+    std::vector<pass_report> reports;
+    swap_options options;
+    options.progress = [&](pass_report const & report) { reports.push_back(report); };
+    compare_and_swap(input, output, 5, rng, options);
+    REQUIRE(reports.size() == 5);
+
+    error_tracker fresh {output.size()};
+    for (size_t i = 0; i < output.size(); i++)
+        fresh.add_pixel(diff2(lab {output[i]}, lab {input[i]}));
+
+    auto const & last = reports.back();
+    REQUIRE(last.pass == 4);
+    REQUIRE(last.total_error == fresh.report().total_error);
+}
+
+
+TEST_CASE("PNG images round trip by rows and whole")
+{
+    permute_rng_type rng {6};
+    auto const image = random_image(37, 53, rng);
+    scratch_directory const scratch {"png"};
+    auto const png = scratch / "round_trip.png";
+
+    write_image(image, png.c_str());
+    REQUIRE(load_image(png.c_str()).data == image.data);
+
+    write_image(image.rows, image.cols, [&](size_t row, rgb * pixels) {
+        std::copy_n(&image(row, 0), image.cols, pixels);
+    }, png.c_str());
+
+    array2d<rgb> streamed(image.rows, image.cols);
+    read_image(
+        png.c_str(),
+        [&](size_t rows, size_t cols) { REQUIRE((rows == 37 and cols == 53)); },
+        [&](size_t row, rgb const * pixels) {
+            std::copy_n(pixels, image.cols, &streamed(row, 0));
+        });
+    REQUIRE(streamed.data == image.data);
+}
+
+
+TEST_CASE("PNG compression options are lossless")
+{
+    png_filter filter {};
+    REQUIRE(parse_png_filter("paeth", filter));
+    REQUIRE(filter == png_filter::paeth);
+    REQUIRE_FALSE(parse_png_filter("fastest", filter));
+
+    // The fast preset, with a level or filter given alongside it overriding it.
+    png_options given {4};
+    REQUIRE(parse_png_options(true, true, "", given));
+    REQUIRE((given.compression == 4 and given.filter == png_options::fast().filter));
+    given = {4};
+    REQUIRE(parse_png_options(true, false, "up", given));
+    REQUIRE((given.compression == png_options::fast().compression
+             and given.filter == png_filter::up));
+    given = {};
+    REQUIRE_FALSE(parse_png_options(false, false, "fastest", given));
+
+    permute_rng_type rng {7};
+    auto const image = random_image(29, 41, rng);
+    auto const none = png_options {0, png_filter::none};
+    auto const smallest = png_options {9, filter};
+    scratch_directory const scratch {"compression"};
+    auto const png = scratch / "compressed.png";
+    for (auto const & options: {png_options::fast(), none, smallest})
+    {
+        REQUIRE(options.valid());
+        write_image(image, png.c_str(), options);
+        REQUIRE(load_image(png.c_str()).data == image.data);
+    }
+
+    REQUIRE_FALSE(png_options {10}.valid());
+}
+
+
+TEST_CASE("raw images round trip by rows and whole")
+{
+    permute_rng_type rng {8};
+    auto const image = random_image(31, 47, rng);
+    scratch_directory const scratch {"raw"};
+    auto const raw = scratch / "round_trip.raw";
+    auto const png = scratch / "round_trip.png";
+    auto const streamed_raw = scratch / "streamed.raw";
+
+    REQUIRE(is_raw_name(raw.c_str()));
+    REQUIRE_FALSE(is_raw_name(png.c_str()));
+
+    write_image(image, raw.c_str());
+    REQUIRE(is_raw_image(raw.c_str()));
+    REQUIRE(load_image(raw.c_str()).data == image.data);
+
+    mapped_image const mapped {raw.c_str()};
+    REQUIRE((mapped.rows() == 31 and mapped.cols() == 47));
+    REQUIRE(std::equal(image.data.begin(), image.data.end(), mapped.data()));
+
+    write_image(image.rows, image.cols, [&](size_t row, rgb * pixels) {
+        std::copy_n(&image(row, 0), image.cols, pixels);
+    }, streamed_raw.c_str());
+
+    array2d<rgb> streamed(image.rows, image.cols);
+    read_image(
+        streamed_raw.c_str(),
+        [&](size_t rows, size_t cols) { REQUIRE((rows == 31 and cols == 47)); },
+        [&](size_t row, rgb const * pixels) {
+            std::copy_n(pixels, image.cols, &streamed(row, 0));
+        });
+    REQUIRE(streamed.data == image.data);
+
+    write_image(image, png.c_str());
+    REQUIRE_FALSE(is_raw_image(png.c_str()));
+    REQUIRE_THROWS(mapped_image {png.c_str()});
+
+    // Headers with no pixels to go with them, or more than could be.
+    auto const corrupt = scratch / "corrupt.raw";
+    auto const write_header = [&](uint64_t rows, uint64_t cols) {
+        std::ofstream file {corrupt, std::ios::binary};
+        file << "RAWRGB24";
+        for (auto const value: {rows, cols})
+        {
+            for (unsigned i = 0; i < 8; i++)
+                file.put(static_cast<char>(value >> (8 * i)));
+        }
+    };
+    write_header(0, 0);
+    REQUIRE(mapped_image {corrupt.c_str()}.rows() == 0);
+    for (auto const & [rows, cols]: {std::pair<uint64_t, uint64_t> {5, 0},
+                                     {0, 5},
+                                     {uint64_t {1} << 63U, 2},
+                                     {uint64_t {1} << 32U, uint64_t {1} << 32U}})
+    {
+        write_header(rows, cols);
+        REQUIRE_THROWS(mapped_image {corrupt.c_str()});
+    }
+}
+
+
+TEST_CASE("pipeline stages match running the engines one by one")
+{
+    std::vector<stage> stages;
+    REQUIRE(parse_stages("a,s5,d3", stages));
+    REQUIRE(stages.size() == 3);
+    REQUIRE(stages[1].kind == stage::engine::swap);
+    REQUIRE(stages[2].passes == 3);
+    REQUIRE_FALSE(parse_stages("", stages));
+    REQUIRE_FALSE(parse_stages("a,s", stages));
+    REQUIRE_FALSE(parse_stages("a,x5", stages));
+    REQUIRE_FALSE(parse_stages("s5d3", stages));
+
+    permute_rng_type rng {9};
+    auto const input = random_image(24, 40, rng);
+    auto const start = random_image(24, 40, rng);
+
+    auto separate = start;
+    permute_rng_type separate_rng {10};
+    match_ascending(input, separate);
+    compare_and_swap(input, separate, 5, separate_rng);
+    compare_and_swap_dithered(input, separate, 3, separate_rng);
+
+    auto piped = start;
+    permute_rng_type piped_rng {10};
+    pipeline {input, piped, {}}.run(stages, piped_rng);
+
+    REQUIRE(piped.data == separate.data);
+}
+
+
+TEST_CASE("run_stats records each phase and pass of a pipeline")
+{
+    permute_rng_type rng {9};
+    auto const input = random_image(24, 40, rng);
+    auto output = random_image(24, 40, rng);
+
+    std::vector<stage> stages;
+    REQUIRE(parse_stages("a,s2,d3", stages));
+
+    run_stats stats;
+    {
+        run_stats::scoped_timer const timer {stats, "load"};
+    }
+    pipeline engines {input, output, {}};
+    engines.record_stats(stats);
+    engines.run(stages, rng);
+    stats.add_counter("pixels", 24 * 40);
+    scratch_directory const scratch {"stats"};
+
+    stats.write(scratch / "stats.csv");
+    std::ifstream csv {scratch / "stats.csv"};
+    std::string line;
+    std::vector<std::string> records;
+    while (std::getline(csv, line))
+        records.push_back(line.substr(0, line.find(',', line.find(',') + 1)));
+    csv.close();
+
+    std::vector<std::string> const expected {
+        "record,name",
+        "counter,pixels",
+        "phase,load",
+        "phase,ascending",
+        "phase,lab",
+        "phase,swap",
+        "phase,dither",
+        "pass,swap",
+        "pass,swap",
+        "pass,dither",
+        "pass,dither",
+        "pass,dither"};
+    REQUIRE(records == expected);
+
+    stats.write(scratch / "stats.json");
+    std::ifstream json {scratch / "stats.json"};
+    std::stringstream text;
+    text << json.rdbuf();
+    auto const last_pass = "\"engine\": \"dither\", \"pass\": 2";
+    REQUIRE(text.str().find(last_pass) != std::string::npos);
+    REQUIRE(text.str().find("\"shuffle_seconds\": ") != std::string::npos);
+
+    // The engines time each pass themselves, with the shuffle a part of it.
+    swap_options timed;
+    int timed_passes = 0;
+    timed.progress = [&](pass_report const & report) {
+        REQUIRE(report.shuffle_seconds > 0);
+        REQUIRE(report.shuffle_seconds <= report.seconds);
+        timed_passes++;
+    };
+    compare_and_swap(input, output, 2, rng, timed);
+    compare_and_swap_dithered(input, output, 2, rng, timed);
+    REQUIRE(timed_passes == 4);
+}
+
+
+TEST_CASE("dithering resumes from a checkpoint with the same result")
+{
+    permute_rng_type rng {11};
+    auto const input = random_image(20, 36, rng);
+    auto const start = random_image(20, 36, rng);
+    std::vector<stage> stages;
+    REQUIRE(parse_stages("s2,d7", stages));
+    scratch_directory const scratch {"checkpoint"};
+    auto const checkpoint = scratch / "dither.checkpoint";
+
+    for (auto const pairs: {pairing::shuffled, pairing::blocked})
+    {
+        swap_options options;
+        options.pairs = pairs;
+        options.block_size = 8;
+
+        auto whole = start;
+        permute_rng_type whole_rng {12};
+        pipeline {input, whole, options}.run(stages, whole_rng);
+
+        // Checkpoints land after passes 3 and 6, and the last one stays.
+        auto stopped = start;
+        permute_rng_type stopped_rng {12};
+        pipeline saving {input, stopped, options};
+        saving.save_checkpoints(checkpoint, 3);
+        saving.run(stages, stopped_rng);
+        REQUIRE(stopped.data == whole.data);
+
+        auto const saved = load_checkpoint(checkpoint);
+        REQUIRE(saved.stage == 1);
+        REQUIRE(saved.dither.passes_done == 6);
+
+        auto resumed = start;
+        permute_rng_type resumed_rng {99};
+        pipeline {input, resumed, options}.resume(stages, saved, resumed_rng);
+        REQUIRE(resumed.data == whole.data);
+        REQUIRE(resumed_rng == whole_rng);
+
+        // Other options would carry on to a different result, so they're refused.
+        REQUIRE(saved.pairs == pairs);
+        auto other_pairs = options;
+        other_pairs.pairs = (pairs == pairing::shuffled) ? pairing::blocked
+                                                          : pairing::shuffled;
+        auto coarser = options;
+        coarser.dither_radius = 2;
+        for (auto const & other: {other_pairs, coarser})
+        {
+            pipeline refusing {input, resumed, other};
+            REQUIRE_THROWS(refusing.resume(stages, saved, resumed_rng));
+        }
+    }
+}
+
+
+TEST_CASE("snapshots write the latest output in the background")
+{
+    permute_rng_type rng {13};
+    auto const first = random_image(17, 23, rng);
+    auto const second = random_image(17, 23, rng);
+    auto const copy_of = [](array2d<rgb> const & image) {
+        return [&image](array2d<rgb> & snapshot) { snapshot.data = image.data; };
+    };
+
+    scratch_directory const scratch {"snapshot"};
+
+    // However far behind the writer is, the last snapshot is always written.
+    {
+        snapshot_writer writer {scratch / "snapshot.png"};
+        writer.offer(1, 17, 23, copy_of(first));
+        writer.offer(2, 17, 23, copy_of(second));
+        writer.wait();
+        REQUIRE(writer.written() + writer.dropped() == 2);
+        auto const snapshot = scratch / "snapshot.png";
+        REQUIRE(load_image(snapshot.c_str()).data == second.data);
+    }
+
+    // Through a pipeline, numbered by passes.
+    auto const input = random_image(20, 36, rng);
+    auto output = random_image(20, 36, rng);
+    std::vector<stage> stages;
+    REQUIRE(parse_stages("s1,d4", stages));
+
+    pipeline engines {input, output, swap_options {}};
+    engines.save_snapshots(scratch / "dither_{pass}.png", 2, png_options::fast());
+    engines.run(stages, rng);
+    REQUIRE(load_image((scratch / "dither_4.png").c_str()).data == output.data);
+}
+
+
+TEST_CASE("batch jobs match running each image alone")
+{
+    permute_rng_type rng {13};
+    std::vector<array2d<rgb>> inputs;
+    inputs.push_back(random_image(16, 24, rng));
+    inputs.push_back(random_image(30, 20, rng));
+    inputs.push_back(random_image(16, 24, rng));
+    scratch_directory const scratch {"batch"};
+    auto const in = [&](size_t i) {
+        return scratch / ("in" + std::to_string(i) + ".png");
+    };
+    for (size_t i = 0; i < inputs.size(); i++)
+        write_image(inputs[i], in(i).c_str());
+
+    auto const manifest_name = scratch / "batch.manifest";
+    {
+        std::ofstream manifest {manifest_name};
+        manifest << "# input output [stages]\n"
+                 << in(0) << " " << scratch / "out0.png" << "\n\n"
+                 << "  " << in(1) << " " << scratch / "out1.raw" << " d2\n"
+                 << in(2) << " " << scratch / "out2.png" << " a,s3\n";
+    }
+
+    std::vector<stage> stages;
+    REQUIRE(parse_stages("s2,d1", stages));
+    auto const jobs = read_manifest(manifest_name, stages);
+    REQUIRE(jobs.size() == 3);
+    REQUIRE(jobs[1].output == scratch / "out1.raw");
+    REQUIRE(jobs[2].stages.size() == 2);
+
+    batch_settings settings;
+    settings.options.threads = 2;
+    settings.seed = 14;
+    settings.large_image = 500; // so that the middle job runs on both threads
+    std::ostringstream log;
+    REQUIRE(run_batch(jobs, settings, log) == 0);
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        auto const & input = inputs[i];
+        array2d<rgb> expected(input.rows, input.cols);
+        expected.data = make_palette(input.size());
+        permute_rng_type job_rng {14};
+        std::shuffle(expected.data.begin(), expected.data.end(), job_rng);
+        pipeline {input, expected, {}}.run(jobs[i].stages, job_rng);
+
+        REQUIRE(load_image(jobs[i].output.c_str()).data == expected.data);
+    }
+
+    // A missing input fails its own job, and only that one.
+    auto broken = jobs;
+    broken[0].input = scratch / "no_such_image.png";
+    REQUIRE(run_batch(broken, settings, log) == 1);
+}
+
+
+TEST_CASE("palette_cache keeps palettes in memory and on disk")
+{
+    palette_cache memory;
+    auto const & palette = memory.get(1000);
+    REQUIRE(palette == make_palette(1000));
+    REQUIRE(&memory.get(1000) == &palette);
+
+    scratch_directory const scratch {"palettes"};
+    palette_cache saving {scratch.name()};
+    REQUIRE(saving.get(1234) == make_palette(1234));
+    REQUIRE(is_raw_image(saving.filename(1234).c_str()));
+
+    // A later cache maps the saved one back in, instead of making it again:
+    // a color changed between the places it checks comes back changed.
+    auto const size = size_t {100'000};
+    auto const name = saving.filename(size);
+    auto touched = saving.get(size);
+    touched[1] = rgb {touched[1] == rgb {0} ? 1U : 0U};
+    write_raw_image(1, size, name.c_str(), [&](size_t) { return touched.data(); });
+    REQUIRE(palette_cache {scratch.name()}.get(size) == touched);
+
+    // A file that isn't the palette, or that's cut short, is made again and
+    // replaced.
+    std::vector<rgb> const all_black(size, rgb {0});
+    write_raw_image(1, size, name.c_str(), [&](size_t) { return all_black.data(); });
+    REQUIRE(palette_cache {scratch.name()}.get(size) == make_palette(size));
+    REQUIRE(load_image(name.c_str()).data == make_palette(size));
+
+    std::filesystem::resize_file(name, std::filesystem::file_size(name) / 2);
+    REQUIRE(palette_cache {scratch.name()}.get(size) == make_palette(size));
+    REQUIRE(load_image(name.c_str()).data == make_palette(size));
+
+    // So is one of the wrong size.
+    write_raw_image(2, 617, saving.filename(1234).c_str(), [](size_t) {
+        static std::vector<rgb> const blacks(617, rgb {0});
+        return blacks.data();
+    });
+    REQUIRE(palette_cache {scratch.name()}.get(1234) == make_palette(1234));
+    REQUIRE(mapped_image {saving.filename(1234).c_str()}.rows() == 1);
+}